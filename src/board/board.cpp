@@ -14,6 +14,32 @@ static inline void stm32_gpio_init()
     Portb::WriteConfig<getMask(GPIOB_LED), Gpio::OutputSlow, Gpio::PushPull>();
 }
 
+/*
+ * Set before the software reset to start the system memory bootloader,
+ * the section is not initialized by the startup code.
+ */
+static uint32_t bootloaderRequest __attribute__((section(".ram0")));
+static constexpr uint32_t BOOTLOADER_MAGIC = 0xDF0B007U;
+static constexpr uint32_t SYSTEM_MEMORY_BASE = 0x1FFFC400U;
+
+/*
+ * Called right after the reset, so the bootloader gets the clocks and the peripherals in the reset state.
+ * The power path outputs are driven low (charging disabled) as the bootloader doesn't touch them.
+ */
+[[noreturn]] static void startBootloader()
+{
+    stm32_gpio_init();
+    RCC->APB2ENR |= RCC_APB2ENR_SYSCFGCOMPEN;
+    SYSCFG->CFGR1 = (SYSCFG->CFGR1 & ~SYSCFG_CFGR1_MEM_MODE) | SYSCFG_CFGR1_MEM_MODE_0;
+    auto* vectors = reinterpret_cast<const uint32_t*>(SYSTEM_MEMORY_BASE);
+    // Back to the main stack pointer used after the reset
+    __set_CONTROL(0);
+    __ISB();
+    __set_MSP(vectors[0]);
+    reinterpret_cast<void (*)()>(vectors[1])();
+    while(true) { }
+}
+
 /*===========================================================================*/
 /* Driver interrupt handlers.                                                */
 /*===========================================================================*/
@@ -29,6 +55,10 @@ static inline void stm32_gpio_init()
  */
 extern "C" void __early_init()
 {
+    if(bootloaderRequest == BOOTLOADER_MAGIC) {
+        bootloaderRequest = 0;
+        startBootloader();
+    }
     stm32_gpio_init();
     stm32_clock_init();
 }
@@ -87,3 +117,12 @@ bool mmc_lld_is_write_protected(MMCDriver* mmcp)
  */
 void boardInit()
 { }
+
+/**
+ * @brief   Restarts the MCU into the system memory USB DFU bootloader.
+ */
+void boardStartBootloader()
+{
+    bootloaderRequest = BOOTLOADER_MAGIC;
+    NVIC_SystemReset();
+}
@@ -104,6 +104,7 @@ extern "C"
 {
 #endif
     void boardInit(void);
+    void boardStartBootloader(void);
 #ifdef __cplusplus
 }
 #endif
@@ -642,7 +642,7 @@
  *          @p panic_msg variable set to @p NULL.
  */
 #if !defined(CH_DBG_ENABLE_STACK_CHECK)
-#define CH_DBG_ENABLE_STACK_CHECK FALSE
+#define CH_DBG_ENABLE_STACK_CHECK TRUE
 #endif
 
 /**
@@ -654,7 +654,7 @@
  * @note    The default is @p FALSE.
  */
 #if !defined(CH_DBG_FILL_THREADS)
-#define CH_DBG_FILL_THREADS FALSE
+#define CH_DBG_FILL_THREADS TRUE
 #endif
 
 /**
@@ -716,7 +716,9 @@
  * @brief   Threads descriptor structure extension.
  * @details User fields added to the end of the @p thread_t structure.
  */
-#define CH_CFG_THREAD_EXTRA_FIELDS /* Add threads custom fields here.*/
+#define CH_CFG_THREAD_EXTRA_FIELDS \
+    uint64_t stats_cycles;         \
+    uint32_t stats_switches;
 
 /**
  * @brief   Threads initialization hook.
@@ -727,9 +729,10 @@
  *
  * @param[in] tp        pointer to the @p thread_t structure
  */
-#define CH_CFG_THREAD_INIT_HOOK(tp)                \
-    {                                              \
-        /* Add threads initialization code here.*/ \
+#define CH_CFG_THREAD_INIT_HOOK(tp) \
+    {                               \
+        (tp)->stats_cycles = 0;     \
+        (tp)->stats_switches = 0;   \
     }
 
 /**
@@ -752,23 +755,23 @@
  */
 #define CH_CFG_CONTEXT_SWITCH_HOOK(ntp, otp) \
     {                                        \
-        /* Context switch code here.*/       \
+        rtStatsSwitchHook(ntp, otp);         \
     }
 
 /**
  * @brief   ISR enter hook.
  */
-#define CH_CFG_IRQ_PROLOGUE_HOOK()   \
-    {                                \
-        /* IRQ prologue code here.*/ \
+#define CH_CFG_IRQ_PROLOGUE_HOOK() \
+    {                              \
+        rtStatsIrqEnterHook();     \
     }
 
 /**
  * @brief   ISR exit hook.
  */
-#define CH_CFG_IRQ_EPILOGUE_HOOK()   \
-    {                                \
-        /* IRQ epilogue code here.*/ \
+#define CH_CFG_IRQ_EPILOGUE_HOOK() \
+    {                              \
+        rtStatsIrqLeaveHook();     \
     }
 
 /**
@@ -847,6 +850,24 @@
 /* Port-specific settings (override port settings defaulted in chcore.h).    */
 /*===========================================================================*/
 
+/*===========================================================================*/
+/* Runtime statistics hooks, see rt_stats.cpp.                               */
+/*===========================================================================*/
+
+#if !defined(_FROM_ASM_)
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    struct ch_thread;
+    void rtStatsSwitchHook(struct ch_thread* ntp, struct ch_thread* otp);
+    void rtStatsIrqEnterHook(void);
+    void rtStatsIrqLeaveHook(void);
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FROM_ASM_ */
+
 #endif /* CHCONF_H */
 
 /** @} */
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FLASH_H
+#define FLASH_H
+
+#include "stm32f0xx.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace flash {
+
+constexpr size_t PAGE_SIZE = 1024;
+
+/*
+ * Embedded flash programming, the CPU stalls on the flash fetches while the operation is in progress.
+ * Every page erase and half-word write runs with the interrupts disabled, the handlers can't be fetched
+ * from the flash anyway, so the functions are safe to call from several threads.
+ * The HSI oscillator must be running.
+ */
+class Flash
+{
+private:
+    static constexpr uint32_t KEY1 = 0x45670123U;
+    static constexpr uint32_t KEY2 = 0xCDEF89ABU;
+
+    static void Unlock()
+    {
+        if(FLASH->CR & FLASH_CR_LOCK) {
+            FLASH->KEYR = KEY1;
+            FLASH->KEYR = KEY2;
+        }
+    }
+    static void Lock()
+    {
+        FLASH->CR |= FLASH_CR_LOCK;
+    }
+    class CriticalSection
+    {
+    private:
+        uint32_t primask_;
+    public:
+        CriticalSection() : primask_{__get_PRIMASK()}
+        {
+            __disable_irq();
+            Unlock();
+        }
+        ~CriticalSection()
+        {
+            Lock();
+            __set_PRIMASK(primask_);
+        }
+    };
+    static bool WaitReady()
+    {
+        while(FLASH->SR & FLASH_SR_BSY) { }
+        const uint32_t status = FLASH->SR;
+        FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPERR;
+        return !(status & (FLASH_SR_PGERR | FLASH_SR_WRPERR));
+    }
+public:
+    // Erases the page containing the address
+    static bool ErasePage(const volatile void* address)
+    {
+        CriticalSection cs;
+        FLASH->CR |= FLASH_CR_PER;
+        FLASH->AR = reinterpret_cast<uintptr_t>(address);
+        FLASH->CR |= FLASH_CR_STRT;
+        bool result = WaitReady();
+        FLASH->CR &= ~FLASH_CR_PER;
+        return result;
+    }
+    // The destination must be erased, every half-word is verified after programming
+    static bool Write(const volatile uint16_t* dest, const uint16_t* src, size_t halfwords)
+    {
+        bool result = true;
+        for(size_t i{}; result && i < halfwords; ++i) {
+            CriticalSection cs;
+            FLASH->CR |= FLASH_CR_PG;
+            *const_cast<volatile uint16_t*>(&dest[i]) = src[i];
+            result = WaitReady() && dest[i] == src[i];
+            FLASH->CR &= ~FLASH_CR_PG;
+        }
+        return result;
+    }
+};
+
+} // flash
+
+#endif // FLASH_H
@@ -24,6 +24,8 @@
 #include "cal_data.h"
 #include "ch.h"
 #include "hal.h"
+#include "settings.h"
+#include "trace.h"
 
 #define ADC_GRP_BUF_DEPTH 16
 #define ADC_GRP_CHANNELS 4
@@ -52,6 +54,11 @@ static const ADCConversionGroup adcgrpcfg = {
 
 void initAdc()
 {
+    for(size_t i{}; i < monitor::AdcChNumber; ++i) {
+        if(const auto saved = settings::read(static_cast<settings::Key>(settings::Calibration + i))) {
+            calibration[i] = *saved;
+        }
+    }
     adcStart(&ADCD1, nullptr);
     adcSTM32SetCCR(ADC_CCR_VREFEN);
 }
@@ -84,9 +91,10 @@ msg_t getVoltages(monitor::adc_data_t& voltages)
         }
         uint32_t vdda = getVdda(avgBuf[ADC_VREF_CHANNEL]);
         for(size_t i{}; i < monitor::AdcChNumber; ++i) {
-            uint16_t val = ((uint64_t)avgBuf[i] * vdda * CAL_DATA[i]) / (FULL_SCALE * 1000 * ADC_GRP_BUF_DEPTH);
+            uint16_t val = ((uint64_t)avgBuf[i] * vdda * calibration[i]) / (FULL_SCALE * 1000 * ADC_GRP_BUF_DEPTH);
             voltages[i] = val;
         }
     }
+    trace::record(trace::AdcBurst, static_cast<uint8_t>(result), voltages[AdcVBat]);
     return result;
 }
@@ -21,6 +21,12 @@
  */
 
 #include "cal_data.h"
+#include <algorithm>
+#include <bit>
+#include <ranges>
+
+// Not constexpr, so reaching it fails the compile time curve validation, the argument tells the reason
+void curveCheckFailed(const char* reason);
 
 constexpr uint16_t CAL_DATA[monitor::AdcChNumber] = {
   1384, // BAT1
@@ -28,7 +34,10 @@ constexpr uint16_t CAL_DATA[monitor::AdcChNumber] = {
   2664  // VBAT
 };
 
-constexpr bat_lut_t DISCHARGE_LUT{{{6250, 0},
+monitor::adc_data_t calibration{CAL_DATA[monitor::AdcBat1], CAL_DATA[monitor::AdcMain], CAL_DATA[monitor::AdcVBat]};
+
+// Li-ion 2S
+static constexpr bat_lut_t LI_ION_DISCHARGE_LUT{{{6250, 0},
                                    {6750, 6},
                                    {6970, 12},
                                    {7100, 18},
@@ -43,7 +52,7 @@ constexpr bat_lut_t DISCHARGE_LUT{{{6250, 0},
                                    {7630, 72},
                                    {7950, 100}}};
 
-constexpr bat_lut_t CHARGE_LUT{{{7000, 0},
+static constexpr bat_lut_t LI_ION_CHARGE_LUT{{{7000, 0},
                                 {7200, 5},
                                 {7400, 10},
                                 {7600, 50},
@@ -57,3 +66,242 @@ constexpr bat_lut_t CHARGE_LUT{{{7000, 0},
                                 {8220, 90},
                                 {8300, 95},
                                 {8395, 100}}};
+
+// LiFePO4 2S
+static constexpr bat_lut_t LIFEPO4_DISCHARGE_LUT{{{5000, 0},
+                                                  {5800, 5},
+                                                  {6100, 10},
+                                                  {6280, 15},
+                                                  {6380, 20},
+                                                  {6440, 30},
+                                                  {6480, 40},
+                                                  {6520, 50},
+                                                  {6550, 60},
+                                                  {6580, 70},
+                                                  {6620, 80},
+                                                  {6660, 90},
+                                                  {6760, 95},
+                                                  {6900, 100}}};
+
+static constexpr bat_lut_t LIFEPO4_CHARGE_LUT{{{6000, 0},
+                                               {6400, 5},
+                                               {6600, 10},
+                                               {6700, 20},
+                                               {6760, 30},
+                                               {6800, 40},
+                                               {6840, 50},
+                                               {6880, 60},
+                                               {6920, 70},
+                                               {6960, 80},
+                                               {7000, 85},
+                                               {7100, 90},
+                                               {7200, 95},
+                                               {7300, 100}}};
+
+/*
+ * Reference conversions, the straightforward LUT walk.
+ * Evaluated only at compile time to validate the precomputed indexes below.
+ */
+static consteval uint32_t referenceLevel(uint32_t val, const bat_lut_t& lut)
+{
+    if(val <= lut.front().first) {
+        return 0;
+    }
+    if(val >= lut.back().first) {
+        return 100;
+    }
+    const auto result = std::ranges::find_if(lut, [val](auto entry) { return entry.first > val; });
+    const auto [v2, p2] = *result;
+    const auto [v1, p1] = *(result - 1);
+    return ((p1 << 8) + ((val - v1) * (p2 - p1) << 8) / (v2 - v1) + 0x80) >> 8;
+}
+
+static consteval uint32_t referenceVoltage(uint32_t val, const bat_lut_t& lut)
+{
+    if(val <= lut.front().second) {
+        return lut.front().first;
+    }
+    if(val >= lut.back().second) {
+        return lut.back().first;
+    }
+    const auto result = std::ranges::find_if(lut, [val](auto entry) { return entry.second > val; });
+    const auto [v2, p2] = *result;
+    const auto [v1, p1] = *(result - 1);
+    auto volt_offset = 10 * (val - p1) * (v2 - v1) / (p2 - p1);
+    return v1 + (volt_offset + 5) / 10;
+}
+
+/*
+ * Bucketed index of a LUT column: the segment is found by a table read at the 2^SHIFT wide bucket
+ * of the argument and the result is interpolated by a multiply-shift with the precomputed segment slope.
+ * The bucket is the widest one that still contains at most one segment boundary.
+ * The inverse index maps percents to voltage.
+ */
+template<const bat_lut_t& lut, bool inverse>
+class LutIndex
+{
+private:
+    static constexpr uint32_t x(size_t i)
+    {
+        return inverse ? lut[i].second : lut[i].first;
+    }
+    static constexpr uint32_t y(size_t i)
+    {
+        return inverse ? lut[i].first : lut[i].second;
+    }
+    static consteval uint32_t bucketShift()
+    {
+        uint32_t width = UINT32_MAX;
+        for(size_t i{}; i < lut.size() - 1; ++i) {
+            if(x(i + 1) <= x(i) || y(i + 1) <= y(i)) {
+                curveCheckFailed("LUT must be strictly increasing");
+            }
+            width = std::min(width, x(i + 1) - x(i));
+        }
+        return std::bit_width(width) - 1;
+    }
+    static constexpr uint32_t SHIFT = bucketShift();
+    // Fixed point of the slopes: percents per mV or mV per percent
+    static constexpr uint32_t Q = inverse ? 8 : 16;
+    static constexpr uint32_t X_MIN = x(0);
+    static constexpr uint32_t X_MAX = x(lut.size() - 1);
+    static constexpr size_t BUCKETS = ((X_MAX - X_MIN) >> SHIFT) + 1;
+    // The LUT segment at the bucket start
+    std::array<uint8_t, BUCKETS> segments_{};
+    // Rounded up to match the reference at the exact halves
+    std::array<uint16_t, lut.size() - 1> slopes_{};
+public:
+    consteval LutIndex()
+    {
+        for(size_t i{}; i < slopes_.size(); ++i) {
+            const uint32_t dx = x(i + 1) - x(i);
+            const uint32_t slope = (((y(i + 1) - y(i)) << Q) + dx - 1) / dx;
+            if(slope > UINT16_MAX) {
+                curveCheckFailed("LUT segment is too steep");
+            }
+            slopes_[i] = slope;
+        }
+        uint8_t segment{};
+        for(size_t i{}; i < BUCKETS; ++i) {
+            while(segment < slopes_.size() - 1 && x(segment + 1) <= X_MIN + (i << SHIFT)) {
+                ++segment;
+            }
+            segments_[i] = segment;
+        }
+    }
+    constexpr uint32_t convert(uint32_t val) const
+    {
+        if(val <= X_MIN) {
+            return y(0);
+        }
+        if(val >= X_MAX) {
+            return y(lut.size() - 1);
+        }
+        uint32_t i = segments_[(val - X_MIN) >> SHIFT];
+        if(val >= x(i + 1)) {
+            ++i;
+        }
+        return ((y(i) << Q) + (val - x(i)) * slopes_[i] + (1U << (Q - 1))) >> Q;
+    }
+};
+
+// Rejects a malformed curve at build time, both conversions must give the same results as the reference ones
+template<const bat_lut_t& lut>
+class BatteryCurve
+{
+private:
+    LutIndex<lut, false> level_;
+    LutIndex<lut, true> voltage_;
+public:
+    consteval BatteryCurve()
+    {
+        if(lut.front().second != 0 || lut.back().second != 100) {
+            curveCheckFailed("LUT must span 0-100%");
+        }
+        for(uint32_t v = lut.front().first - 1; v <= lut.back().first + 1U; ++v) {
+            if(level_.convert(v) != referenceLevel(v, lut)) {
+                curveCheckFailed("Level conversion mismatch");
+            }
+        }
+        for(uint32_t p{}; p <= 101; ++p) {
+            if(voltage_.convert(p) != referenceVoltage(p, lut)) {
+                curveCheckFailed("Voltage conversion mismatch");
+            }
+        }
+    }
+    constexpr uint8_t level(uint16_t vBat) const
+    {
+        return level_.convert(vBat);
+    }
+    constexpr uint16_t voltage(uint8_t percents) const
+    {
+        return voltage_.convert(percents);
+    }
+};
+
+template<const bat_lut_t& dischargeLut, const bat_lut_t& chargeLut>
+class ProfileCurves
+{
+private:
+    static constexpr BatteryCurve<dischargeLut> DISCHARGE{};
+    static constexpr BatteryCurve<chargeLut> CHARGE{};
+public:
+    static uint8_t level(uint16_t vBat, monitor::State st)
+    {
+        return st == monitor::State::Discharge ? DISCHARGE.level(vBat) : CHARGE.level(vBat);
+    }
+    static uint16_t voltage(uint8_t percents, monitor::State st)
+    {
+        return st == monitor::State::Discharge ? DISCHARGE.voltage(percents) : CHARGE.voltage(percents);
+    }
+};
+
+using LiIonCurves = ProfileCurves<LI_ION_DISCHARGE_LUT, LI_ION_CHARGE_LUT>;
+using LiFePO4Curves = ProfileCurves<LIFEPO4_DISCHARGE_LUT, LIFEPO4_CHARGE_LUT>;
+
+static constexpr BatteryProfile PROFILES[] = {
+  {.name = "li-ion-2s",
+   .level = LiIonCurves::level,
+   .voltage = LiIonCurves::voltage,
+   .chargeCutoff = 4100,
+   .idleDischargeCutoff = 3750,
+   .criticalLevel = 3500,
+   .trickleHyst = 100,
+   .cells = 2},
+  {.name = "lifepo4-2s",
+   .level = LiFePO4Curves::level,
+   .voltage = LiFePO4Curves::voltage,
+   .chargeCutoff = 3500,
+   .idleDischargeCutoff = 3270,
+   .criticalLevel = 3050,
+   .trickleHyst = 50,
+   .cells = 2},
+};
+
+const std::span<const BatteryProfile> BATTERY_PROFILES{PROFILES};
+
+static std::atomic<const BatteryProfile*> activeProfile{PROFILES};
+
+const BatteryProfile& batteryProfile()
+{
+    return *activeProfile.load(std::memory_order_relaxed);
+}
+
+bool selectBatteryProfile(size_t index)
+{
+    if(index >= std::size(PROFILES)) {
+        return false;
+    }
+    activeProfile.store(&PROFILES[index], std::memory_order_relaxed);
+    return true;
+}
+
+uint8_t batteryLevel(uint16_t vBat, monitor::State st)
+{
+    return batteryProfile().level(vBat, st);
+}
+
+uint16_t batteryVoltage(uint8_t percents, monitor::State st)
+{
+    return batteryProfile().voltage(percents, st);
+}
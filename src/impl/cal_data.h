@@ -24,16 +24,42 @@
 #define CAL_DATA_H
 
 #include "monitor.h"
+#include <array>
 #include <cstdint>
+#include <span>
 #include <tuple>
 
 // ADC voltage calibration values
 constexpr uint32_t FULL_SCALE = 4095U;
 extern const uint16_t CAL_DATA[monitor::AdcChNumber];
+// In use, the defaults above are replaced by the saved ones on the ADC init
+extern monitor::adc_data_t calibration;
 
+// Battery voltage (mV) to level (%) curve, validated at compile time
 using bat_lut_t = std::array<std::pair<uint16_t, uint16_t>, 14>;
 
-extern const bat_lut_t DISCHARGE_LUT;
-extern const bat_lut_t CHARGE_LUT;
+struct BatteryProfile
+{
+    const char* name;
+    // Constant time conversions using the curve of the state: the discharge one or the charge one otherwise
+    uint8_t (*level)(uint16_t vBat, monitor::State st);
+    uint16_t (*voltage)(uint8_t percents, monitor::State st);
+    // Per cell, mV
+    uint16_t chargeCutoff;
+    uint16_t idleDischargeCutoff;
+    uint16_t criticalLevel;
+    uint16_t trickleHyst;
+    uint8_t cells;
+};
+
+extern const std::span<const BatteryProfile> BATTERY_PROFILES;
+
+// The first profile is active by default
+const BatteryProfile& batteryProfile();
+bool selectBatteryProfile(size_t index);
+
+// Conversions of the active profile
+uint8_t batteryLevel(uint16_t vBat, monitor::State st);
+uint16_t batteryVoltage(uint8_t percents, monitor::State st);
 
 #endif // CAL_DATA_H
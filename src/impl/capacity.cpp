@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "capacity.h"
+#include "cal_data.h"
+#include "ch.h"
+#include "chprintf.h"
+#include "settings.h"
+#include <algorithm>
+#include <array>
+
+namespace capacity {
+
+using monitor::State;
+
+/*
+ * There is no current sensor, so the load of a learning discharge is assumed constant: the level falls
+ * linearly in time from the start level to the level of the critical voltage. The VBAT recorded during
+ * the discharge is compared with the profile curve at these levels every 10%, the differences are
+ * the curve correction. The duration gives the run time of the full charge at that load.
+ * A new result is blended with the learned one, so a single unusual discharge has a limited effect.
+ */
+static constexpr uint8_t STEP = 10;
+static constexpr uint8_t POINTS = 100 / STEP + 1;
+// The offsets are kept in 8mV units, packed by 4 into the settings values
+static constexpr uint8_t OFFSET_UNIT = 8;
+static constexpr uint8_t CORRECTION_KEYS = (POINTS + 3) / 4;
+static_assert(settings::CurveCorrection + CORRECTION_KEYS == settings::KeysNumber);
+// The discharge must start charged and last long enough to be representative
+static constexpr uint8_t START_LEVEL_MIN = 90;
+static constexpr uint32_t DURATION_MIN_S = 5 * 60;
+static constexpr uint32_t RUN_TIME_MAX = 0xFFFFFF;
+
+static std::array<int8_t, POINTS> offsets;
+// s, from 100% to 0%
+static uint32_t fullRunTime;
+static uint8_t cycles;
+
+// VBAT of the discharge, the sampling stride doubles when the buffer is full, so any duration fits
+class Recorder
+{
+private:
+    static constexpr uint16_t VBAT_BASE = 4800;
+    static constexpr uint8_t VBAT_SHIFT = 4;
+    std::array<uint8_t, 32> samples_;
+    uint32_t cycles_{};
+    uint32_t stride_{1};
+    uint8_t size_{};
+
+    static uint16_t decode(uint8_t val)
+    {
+        return VBAT_BASE + (val << VBAT_SHIFT);
+    }
+public:
+    void add(uint16_t vBat)
+    {
+        if(cycles_++ % stride_) {
+            return;
+        }
+        if(size_ == samples_.size()) {
+            for(size_t i{}; i < samples_.size() / 2; ++i) {
+                samples_[i] = samples_[i * 2];
+            }
+            size_ /= 2;
+            stride_ *= 2;
+        }
+        samples_[size_++] = std::clamp((vBat - VBAT_BASE) >> VBAT_SHIFT, 0, UINT8_MAX);
+    }
+    uint32_t cycles() const
+    {
+        return cycles_;
+    }
+    // Interpolated between the samples
+    uint16_t at(uint32_t cycle) const
+    {
+        const size_t i = std::min<size_t>(cycle / stride_, size_ - 1);
+        const int32_t v0 = decode(samples_[i]);
+        if(i + 1 == size_) {
+            return v0;
+        }
+        const int32_t v1 = decode(samples_[i + 1]);
+        return v0 + (v1 - v0) * static_cast<int32_t>(cycle - i * stride_) / static_cast<int32_t>(stride_);
+    }
+};
+
+static Recorder recorder;
+static uint8_t startLevel;
+static bool learning;
+static State prevState;
+
+// mV
+static int32_t offsetAt(uint8_t percents)
+{
+    const uint8_t i = std::min(percents / STEP, POINTS - 2);
+    const int32_t frac = percents - i * STEP;
+    return (offsets[i] * (STEP - frac) + offsets[i + 1] * frac) * OFFSET_UNIT / STEP;
+}
+
+uint8_t level(uint16_t vBat, State st)
+{
+    const auto& profile = batteryProfile();
+    if(st != State::Discharge) {
+        return profile.level(vBat, st);
+    }
+    const int32_t corrected = vBat - offsetAt(profile.level(vBat, st));
+    return profile.level(std::clamp<int32_t>(corrected, 0, UINT16_MAX), st);
+}
+
+uint16_t voltage(uint8_t percents, State st)
+{
+    const auto& profile = batteryProfile();
+    const int32_t nominal = profile.voltage(percents, st);
+    if(st != State::Discharge) {
+        return nominal;
+    }
+    return std::clamp<int32_t>(nominal + offsetAt(percents), 0, UINT16_MAX);
+}
+
+uint16_t runTime(uint16_t soc)
+{
+    if(!fullRunTime) {
+        return monitor::RUN_TIME_UNKNOWN;
+    }
+    return std::min<uint64_t>(static_cast<uint64_t>(fullRunTime) * soc / (100 << 8), monitor::RUN_TIME_UNKNOWN - 1);
+}
+
+static bool save()
+{
+    bool result = settings::write(settings::LearnedRunTime, cycles << 24 | fullRunTime);
+    for(uint8_t key{}; key < CORRECTION_KEYS; ++key) {
+        uint32_t packed{};
+        for(uint8_t i = key * 4; i < std::min(key * 4 + 4, +POINTS); ++i) {
+            packed |= static_cast<uint8_t>(offsets[i]) << (i % 4 * 8);
+        }
+        result = settings::write(static_cast<settings::Key>(settings::CurveCorrection + key), packed) && result;
+    }
+    return result;
+}
+
+static void learn()
+{
+    const auto& profile = batteryProfile();
+    const uint32_t total = recorder.cycles();
+    const uint32_t durationS = total * monitor::PERIOD_MS / 1000;
+    // The nominal level, the critical voltage is the end of the discharge whatever the pack condition is
+    const uint8_t endLevel = profile.level(profile.criticalLevel * profile.cells, State::Discharge);
+    if(durationS < DURATION_MIN_S || startLevel <= endLevel) {
+        return;
+    }
+    const uint8_t span = startLevel - endLevel;
+    const uint32_t learnedRunTime = std::min(durationS * 100 / span, RUN_TIME_MAX);
+    for(uint8_t i{}; i < POINTS; ++i) {
+        const uint8_t pointLevel = i * STEP;
+        if(pointLevel < endLevel || pointLevel > startLevel) {
+            continue;
+        }
+        const int32_t vBat = recorder.at((startLevel - pointLevel) * total / span);
+        const auto offset = static_cast<int8_t>(std::clamp<int32_t>(
+          (vBat - profile.voltage(pointLevel, State::Discharge)) / OFFSET_UNIT, INT8_MIN, INT8_MAX));
+        offsets[i] = cycles ? (offsets[i] * 3 + offset) / 4 : offset;
+    }
+    fullRunTime = cycles ? (fullRunTime * 3 + learnedRunTime) / 4 : learnedRunTime;
+    cycles = std::min(cycles + 1, UINT8_MAX);
+    save();
+}
+
+void update(State st, uint8_t level, uint16_t vBat, bool critical)
+{
+    if(st != prevState) {
+        prevState = st;
+        learning = st == State::Discharge && level >= START_LEVEL_MIN;
+        if(learning) {
+            recorder = {};
+            startLevel = level;
+        }
+    }
+    if(!learning) {
+        return;
+    }
+    recorder.add(vBat);
+    if(critical) {
+        learning = false;
+        learn();
+    }
+}
+
+void load()
+{
+    if(const auto saved = settings::read(settings::LearnedRunTime)) {
+        cycles = *saved >> 24;
+        fullRunTime = *saved & RUN_TIME_MAX;
+    }
+    for(uint8_t key{}; key < CORRECTION_KEYS; ++key) {
+        const uint32_t packed =
+          settings::read(static_cast<settings::Key>(settings::CurveCorrection + key)).value_or(0);
+        for(uint8_t i = key * 4; i < std::min(key * 4 + 4, +POINTS); ++i) {
+            offsets[i] = static_cast<int8_t>(packed >> (i % 4 * 8));
+        }
+    }
+}
+
+bool reset()
+{
+    chSysLock();
+    offsets = {};
+    fullRunTime = 0;
+    cycles = 0;
+    learning = false;
+    chSysUnlock();
+    return save();
+}
+
+void dump(BaseSequentialStream* chp)
+{
+    chSysLock();
+    const auto snapshot = offsets;
+    const uint32_t runTimeS = fullRunTime;
+    const uint8_t learned = cycles;
+    const bool active = learning;
+    chSysUnlock();
+    chprintf(chp, "cycles=%u full_runtime=%u learning=%u\r\n", learned, runTimeS, active);
+    for(uint8_t i{}; i < POINTS; ++i) {
+        chprintf(chp, "%u%% %dmV\r\n", i * STEP, snapshot[i] * OFFSET_UNIT);
+    }
+}
+
+} // capacity
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef CAPACITY_H
+#define CAPACITY_H
+
+#include "hal.h"
+#include "monitor.h"
+#include <cstdint>
+
+namespace capacity {
+
+// Conversions of the active profile, the discharge curve is corrected by the learned offsets
+uint8_t level(uint16_t vBat, monitor::State st);
+uint16_t voltage(uint8_t percents, monitor::State st);
+
+// Called by the monitor every cycle, learns from the discharges started charged and ended at the critical level
+void update(monitor::State st, uint8_t level, uint16_t vBat, bool critical);
+// Predicted run time from the level (Q8 percents) at the load of the learning discharges, RUN_TIME_UNKNOWN
+// if nothing is learned
+uint16_t runTime(uint16_t soc);
+
+// Loads the learned data
+void load();
+// Forgets the learned data, e.g. for a new pack or a new profile
+bool reset();
+void dump(BaseSequentialStream* chp);
+
+} // capacity
+
+#endif // CAPACITY_H
@@ -25,8 +25,10 @@
 #include "chprintf.h"
 // clang-format on
 
+#include "cal_data.h"
 #include "monitor.h"
 #include "ssd1306.h"
+#include "trace.h"
 #include "type_traits_ex.h"
 #include <cstdio>
 #include <cstdlib>
@@ -162,7 +164,7 @@ static void displayStatus()
     Disp::SetXY(valuesXpos, valuesYpos + 1);
     auto vBat = voltages[AdcVBat].load(std::memory_order_relaxed);
     auto vMain = voltages[AdcMain].load(std::memory_order_relaxed);
-    auto vBal = abs(vBat - (voltages[AdcBat1].load(std::memory_order_relaxed) * 2));
+    auto vBal = abs(vBat - (voltages[AdcBat1].load(std::memory_order_relaxed) * batteryProfile().cells));
     auto vBatFixed = mv2v(vBat);
     auto vMainFixed = mv2v(vMain);
     chprintf(ds.getBase(),
@@ -187,7 +189,9 @@ THD_FUNCTION(displayThread, )
     chThdSleepSeconds(3);
     Disp::Fill();
     while(true) {
+        trace::record(trace::DisplayStart);
         displayStatus();
+        trace::record(trace::DisplayEnd);
         chThdSleepSeconds(1);
     }
 }
@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "events.h"
+#include "ch.h"
+#include "chprintf.h"
+#include "flash.h"
+#include <array>
+
+namespace events {
+
+/*
+ * Append-only log in two flash pages, reserved in the firmware image and erased after the flashing.
+ * The record is two half-words: the type in the upper 4 bits and the seconds elapsed since
+ * the previous record in the lower 12 bits, followed by the value.
+ * Every page starts with the header holding the 28 bits page sequence number and the absolute uptime record,
+ * the oldest page is erased when the active one is full. The flash endurance runs out long before
+ * the sequence number overflows.
+ * The cursor is the position of the record: page sequence number * RECORDS + slot.
+ */
+struct Record
+{
+    uint16_t head;
+    uint16_t value;
+};
+
+static constexpr size_t PAGES = 2;
+static constexpr size_t RECORDS = flash::PAGE_SIZE / sizeof(Record);
+static constexpr uint8_t PAGE_HEADER = 0x0E;
+static constexpr uint8_t ERASED = 0x0F;
+static constexpr uint32_t DELTA_MAX = 0x0FFF;
+
+using page_t = std::array<Record, RECORDS>;
+
+alignas(flash::PAGE_SIZE) static constinit const std::array<page_t, PAGES> pages = [] {
+    std::array<page_t, PAGES> result;
+    for(auto& page : result) {
+        page.fill({UINT16_MAX, UINT16_MAX});
+    }
+    return result;
+}();
+
+static constexpr const char* typeString[] = {
+  "boot", "uptime", "mains-lost", "mains-restored", "state", "time-sync", "epoch-high", "ir-charge", "ir-load"};
+
+static MUTEX_DECL(mutex);
+// PAGES until the first record in the blank log
+static size_t active = PAGES;
+static size_t freeSlot;
+static uint32_t lastTime;
+static bool initialized;
+
+// The page content is changed at runtime
+static Record readRecord(size_t page, size_t slot)
+{
+    const auto* record = reinterpret_cast<const volatile uint16_t*>(&pages[page][slot]);
+    return {record[0], record[1]};
+}
+
+static uint8_t type(const Record& record)
+{
+    return record.head >> 12;
+}
+
+static uint32_t wide(const Record& record)
+{
+    return (record.head & DELTA_MAX) << 16 | record.value;
+}
+
+static bool isErased(const Record& record)
+{
+    return record.head == UINT16_MAX && record.value == UINT16_MAX;
+}
+
+static uint32_t sequence(size_t page)
+{
+    return wide(readRecord(page, 0));
+}
+
+static bool isValid(size_t page)
+{
+    return type(readRecord(page, 0)) == PAGE_HEADER;
+}
+
+static uint32_t seconds()
+{
+    return chVTGetTimeStamp() / CH_CFG_ST_FREQUENCY;
+}
+
+static void init()
+{
+    for(size_t page{}; page < PAGES; ++page) {
+        if(isValid(page) && (active == PAGES || sequence(page) > sequence(active))) {
+            active = page;
+        }
+    }
+    if(active != PAGES) {
+        freeSlot = 1;
+        while(freeSlot < RECORDS && !isErased(readRecord(active, freeSlot))) {
+            ++freeSlot;
+        }
+    }
+    initialized = true;
+}
+
+static bool program(Record record)
+{
+    return flash::Flash::Write(&pages[active][freeSlot++].head, &record.head, 2);
+}
+
+static bool write(uint8_t type, uint32_t value)
+{
+    return program({static_cast<uint16_t>(type << 12 | (value >> 16 & DELTA_MAX)), static_cast<uint16_t>(value)});
+}
+
+static bool startPage(uint32_t now)
+{
+    const uint32_t seq = active == PAGES ? 0 : sequence(active) + 1;
+    active = active == PAGES ? 0 : (active + 1) % PAGES;
+    freeSlot = 0;
+    lastTime = now;
+    return flash::Flash::ErasePage(&pages[active]) && write(PAGE_HEADER, seq) && write(Uptime, now);
+}
+
+// The mutex must be held
+static void append(Type type, uint32_t value)
+{
+    if(!initialized) {
+        init();
+    }
+    const uint32_t now = seconds();
+    bool result = true;
+    // Room for the uptime record in case of the delta overflow and the upper half of the value
+    if(active == PAGES || freeSlot >= RECORDS - 2) {
+        result = startPage(now);
+    }
+    if(type == Boot) {
+        lastTime = 0;
+    }
+    uint32_t delta = now - lastTime;
+    if(result && delta > DELTA_MAX) {
+        result = write(Uptime, now);
+        delta = 0;
+    }
+    if(result && type == TimeSync) {
+        result = write(EpochHigh, value >> 16);
+    }
+    if(result) {
+        program({static_cast<uint16_t>(type << 12 | delta), static_cast<uint16_t>(value)});
+    }
+    lastTime = now;
+}
+
+void record(Type type, uint16_t value)
+{
+    chMtxLock(&mutex);
+    append(type, value);
+    chMtxUnlock(&mutex);
+}
+
+void recordTimeSync(uint32_t epochS)
+{
+    chMtxLock(&mutex);
+    append(TimeSync, epochS);
+    chMtxUnlock(&mutex);
+}
+
+// Records of a page taken under the mutex, printed without holding it
+struct Span
+{
+    size_t page;
+    uint32_t seq;
+    size_t end;
+};
+
+static void dumpPage(BaseSequentialStream* chp, const Span& span, uint32_t cursor)
+{
+    const uint32_t base = span.seq * RECORDS;
+    uint32_t time{};
+    uint32_t high{};
+    for(size_t slot = 1; slot < span.end; ++slot) {
+        const Record record = readRecord(span.page, slot);
+        // The page has been erased for the new records meanwhile, the rest is lost
+        if(sequence(span.page) != span.seq) {
+            break;
+        }
+        const uint8_t t = type(record);
+        if(t == Uptime) {
+            time = wide(record);
+            continue;
+        }
+        if(t == EpochHigh) {
+            high = wide(record) << 16;
+            continue;
+        }
+        time = (t == Boot ? 0 : time) + (record.head & DELTA_MAX);
+        if(base + slot >= cursor && t < std::size(typeString)) {
+            const uint32_t value = (t == TimeSync ? high : 0) | record.value;
+            chprintf(chp, "%u %u %s %u\r\n", base + slot, time, typeString[t], value);
+        }
+    }
+}
+
+/*
+ * The output blocks while the host doesn't read it, the monitor must not wait for the mutex meanwhile.
+ * The written records never change until the page is erased, only the bounds are taken under the mutex.
+ */
+void dump(BaseSequentialStream* chp, uint32_t cursor)
+{
+    Span spans[PAGES];
+    size_t count{};
+    chMtxLock(&mutex);
+    if(!initialized) {
+        init();
+    }
+    uint32_t next{};
+    if(active != PAGES) {
+        const size_t oldest = (active + 1) % PAGES;
+        if(isValid(oldest) && sequence(oldest) + 1 == sequence(active)) {
+            spans[count++] = {oldest, sequence(oldest), RECORDS};
+        }
+        spans[count++] = {active, sequence(active), freeSlot};
+        next = sequence(active) * RECORDS + freeSlot;
+    }
+    chMtxUnlock(&mutex);
+    // The cursor is ahead of the log after the re-flash restarted the sequence, the host gets the whole log again
+    if(cursor > next) {
+        cursor = 0;
+    }
+    for(size_t i{}; i < count; ++i) {
+        dumpPage(chp, spans[i], cursor);
+    }
+    chprintf(chp, "next=%u\r\n", next);
+}
+
+} // events
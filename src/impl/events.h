@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include "hal.h"
+#include <cstdint>
+
+namespace events {
+
+enum Type : uint8_t {
+    Boot,          // value: reset flags, RCC_CSR >> 24
+    Uptime,        // absolute uptime, written at the page start and when the delta overflows
+    MainsLost,     // value: VBAT mV
+    MainsRestored, // value: minimal VBAT during the discharge, mV
+    StateChange,   // value: previous state << 4 | new state, other than the mains ones
+    TimeSync,      // value: host epoch seconds, the upper half-word is kept in the preceding EpochHigh record
+    EpochHigh,
+    IrCharge, // value: VBAT step when the charger is enabled, mV
+    IrLoad,   // value: VBAT step on the mains loss, mV
+};
+
+// Appends the event to the persistent log in flash, called from the monitor thread
+void record(Type type, uint16_t value);
+void recordTimeSync(uint32_t epochS);
+// Prints the events starting from the cursor position, the last line is the cursor of the next event.
+// A cursor past the end of the log, e.g. from before the re-flash, prints the whole log
+void dump(BaseSequentialStream* chp, uint32_t cursor);
+
+} // events
+
+#endif // EVENTS_H
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "history.h"
+#include "ch.h"
+#include "chprintf.h"
+#include "monitor.h"
+#include <algorithm>
+#include <array>
+
+namespace history {
+
+/*
+ * Downsampling pyramid: the monitor samples are aggregated into 1 minute buckets,
+ * those are aggregated into 15 minute buckets. Every level keeps its own ring.
+ * 30 minutes and 12 hours are covered. The bucket is compressed to 4 bytes to fit the RAM:
+ * VBAT with 16mV resolution, Main with 64mV.
+ */
+struct Bucket
+{
+    uint8_t vBatMin;
+    uint8_t vBatMean;
+    uint8_t vBatMax;
+    uint8_t vMainMin;
+};
+
+static constexpr uint16_t VBAT_BASE = 4800;
+static constexpr uint8_t VBAT_SHIFT = 4;
+static constexpr uint8_t VMAIN_SHIFT = 6;
+
+static constexpr uint8_t encodeVBat(uint16_t val)
+{
+    return std::clamp((val - VBAT_BASE) >> VBAT_SHIFT, 0, UINT8_MAX);
+}
+
+static constexpr uint16_t decodeVBat(uint8_t val)
+{
+    return VBAT_BASE + (val << VBAT_SHIFT);
+}
+
+static constexpr uint8_t encodeVMain(uint16_t val)
+{
+    return std::min(val >> VMAIN_SHIFT, UINT8_MAX);
+}
+
+static constexpr uint16_t decodeVMain(uint8_t val)
+{
+    return val << VMAIN_SHIFT;
+}
+
+// Aggregates the input samples into the bucket of the level
+class Accumulator
+{
+private:
+    uint32_t sum_{};
+    uint16_t count_{};
+    uint16_t vBatMin_{UINT16_MAX};
+    uint16_t vBatMax_{};
+    uint16_t vMainMin_{UINT16_MAX};
+public:
+    void add(uint16_t vBatMin, uint16_t vBatMean, uint16_t vBatMax, uint16_t vMainMin)
+    {
+        sum_ += vBatMean;
+        ++count_;
+        vBatMin_ = std::min(vBatMin_, vBatMin);
+        vBatMax_ = std::max(vBatMax_, vBatMax);
+        vMainMin_ = std::min(vMainMin_, vMainMin);
+    }
+    uint16_t count() const
+    {
+        return count_;
+    }
+    // Completes the bucket and restarts the aggregation
+    Bucket take()
+    {
+        Bucket result{encodeVBat(vBatMin_), encodeVBat(sum_ / count_), encodeVBat(vBatMax_), encodeVMain(vMainMin_)};
+        *this = {};
+        return result;
+    }
+};
+
+template<size_t N>
+class Ring
+{
+private:
+    std::array<Bucket, N> buckets_;
+    uint8_t head_{};
+    uint8_t size_{};
+public:
+    void push(Bucket bucket)
+    {
+        buckets_[head_] = bucket;
+        head_ = (head_ + 1) % N;
+        size_ = std::min<size_t>(size_ + 1, N);
+    }
+    size_t size() const
+    {
+        return size_;
+    }
+    // The oldest is 0
+    Bucket operator[](size_t index) const
+    {
+        return buckets_[(head_ + N - size_ + index) % N];
+    }
+};
+
+struct Level
+{
+    const char* name;
+    uint32_t periodS;
+};
+
+static constexpr uint32_t MINUTE_SAMPLES = 60 * 1000 / monitor::PERIOD_MS;
+static constexpr uint32_t QUARTER_MINUTES = 15;
+static constexpr Level LEVELS[] = {{"1m", 60}, {"15m", 15 * 60}};
+
+static Accumulator minuteAcc;
+static Accumulator quarterAcc;
+static Ring<30> minutes;
+static Ring<48> quarters;
+// Uptime of the last completed minute
+static uint32_t lastMinuteS;
+
+void add(uint16_t vMain, uint16_t vBat)
+{
+    minuteAcc.add(vBat, vBat, vBat, vMain);
+    if(minuteAcc.count() < MINUTE_SAMPLES) {
+        return;
+    }
+    const Bucket minute = minuteAcc.take();
+    quarterAcc.add(decodeVBat(minute.vBatMin),
+                   decodeVBat(minute.vBatMean),
+                   decodeVBat(minute.vBatMax),
+                   decodeVMain(minute.vMainMin));
+    chSysLock();
+    minutes.push(minute);
+    if(quarterAcc.count() == QUARTER_MINUTES) {
+        quarters.push(quarterAcc.take());
+    }
+    lastMinuteS = chVTGetTimeStampI() / CH_CFG_ST_FREQUENCY;
+    chSysUnlock();
+}
+
+template<size_t N>
+static void dumpLevel(BaseSequentialStream* chp, const Level& level, const Ring<N>& ring, uint32_t endS)
+{
+    chSysLock();
+    const size_t size = ring.size();
+    chSysUnlock();
+    for(size_t i{}; i < size; ++i) {
+        chSysLock();
+        const Bucket bucket = ring[i];
+        chSysUnlock();
+        chprintf(chp,
+                 "%s %d %u %u %u %u\r\n",
+                 level.name,
+                 static_cast<int32_t>(endS - (size - i) * level.periodS),
+                 decodeVBat(bucket.vBatMin),
+                 decodeVBat(bucket.vBatMean),
+                 decodeVBat(bucket.vBatMax),
+                 decodeVMain(bucket.vMainMin));
+    }
+}
+
+void dump(BaseSequentialStream* chp)
+{
+    chSysLock();
+    const uint32_t endS = lastMinuteS;
+    const uint32_t quarterEndS = endS - quarterAcc.count() * LEVELS[0].periodS;
+    chSysUnlock();
+    dumpLevel(chp, LEVELS[1], quarters, quarterEndS);
+    dumpLevel(chp, LEVELS[0], minutes, endS);
+}
+
+/*
+ * The transitions are rare, all the steps fit a short ring. The trend is the moving average
+ * of every kind, its growth shows the pack aging.
+ */
+static constexpr size_t IR_STEPS = 8;
+static constexpr uint16_t IR_KIND_FLAG = 0x8000;
+// Q4 mV, weight of the new step is 1/8
+static constexpr uint8_t IR_TREND_SHIFT = 3;
+static constexpr uint16_t IR_STEP_MAX = UINT16_MAX >> 4;
+static constexpr const char* irKindString[] = {"charge", "load"};
+
+static std::array<uint32_t, IR_STEPS> irUptimes;
+// The kind in the upper bit
+static std::array<uint16_t, IR_STEPS> irSteps;
+static uint8_t irHead;
+static uint8_t irSize;
+static std::array<uint16_t, IrKindsNumber> irTrends;
+static std::array<uint16_t, IrKindsNumber> irCounts;
+
+void addIr(IrKind kind, uint16_t stepMv)
+{
+    stepMv = std::min(stepMv, IR_STEP_MAX);
+    chSysLock();
+    irUptimes[irHead] = chVTGetTimeStampI() / CH_CFG_ST_FREQUENCY;
+    irSteps[irHead] = (kind == IrLoad ? IR_KIND_FLAG : 0) | stepMv;
+    irHead = (irHead + 1) % IR_STEPS;
+    irSize = std::min<size_t>(irSize + 1, IR_STEPS);
+    uint16_t& trend = irTrends[kind];
+    trend = irCounts[kind]++ ? trend - (trend >> IR_TREND_SHIFT) + (stepMv << 4 >> IR_TREND_SHIFT) : stepMv << 4;
+    chSysUnlock();
+}
+
+void dumpIr(BaseSequentialStream* chp)
+{
+    chSysLock();
+    const auto trends = irTrends;
+    const auto counts = irCounts;
+    const auto uptimes = irUptimes;
+    const auto steps = irSteps;
+    const size_t head = irHead;
+    const size_t size = irSize;
+    chSysUnlock();
+    for(size_t kind{}; kind < IrKindsNumber; ++kind) {
+        chprintf(chp, "%s trend=%u count=%u\r\n", irKindString[kind], trends[kind] >> 4, counts[kind]);
+    }
+    for(size_t i{}; i < size; ++i) {
+        const size_t index = (head + IR_STEPS - size + i) % IR_STEPS;
+        const uint16_t step = steps[index];
+        chprintf(chp, "%s %u %u\r\n", irKindString[step >> 15], uptimes[index], step & ~IR_KIND_FLAG);
+    }
+}
+
+} // history
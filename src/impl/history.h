@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "hal.h"
+#include <cstdint>
+
+namespace history {
+
+// Called by the monitor every cycle
+void add(uint16_t vMain, uint16_t vBat);
+// Prints the aggregates, the oldest first
+void dump(BaseSequentialStream* chp);
+
+// VBAT steps of the power path transitions measured by the monitor, the internal resistance proxy
+enum IrKind : uint8_t { IrCharge, IrLoad, IrKindsNumber };
+void addIr(IrKind kind, uint16_t stepMv);
+// Prints the trend of every kind, then the latest steps, the oldest first
+void dumpIr(BaseSequentialStream* chp);
+
+} // history
+
+#endif // HISTORY_H
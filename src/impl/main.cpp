@@ -24,7 +24,9 @@
 #include "display_handler.h"
 #include "hal.h"
 #include "monitor.h"
+#include "rt_stats.h"
 #include "shell_handler.h"
+#include "stream_handler.h"
 #include "usbcfg.h"
 
 int main()
@@ -38,14 +40,17 @@ int main()
      */
     halInit();
     chSysInit();
+    stats::init();
     // Remap USB pins
     SYSCFG->CFGR1 |= SYSCFG_CFGR1_PA11_PA12_RMP;
 
     /*
-     * Initializes a serial-over-USB CDC driver.
+     * Initializes the serial-over-USB CDC drivers.
      */
     sduObjectInit(&SDU1);
     sduStart(&SDU1, &serusbcfg);
+    sduObjectInit(&SDU2);
+    sduStart(&SDU2, &serusbcfg2);
 
     /*
      * Activates the USB driver and then the USB bus pull-up on D+.
@@ -61,6 +66,7 @@ int main()
     monitor::run();
     display::run();
     shellRun();
+    stream::run();
 
     using namespace monitor;
     uint16_t onTime{}, offTime{};
@@ -21,29 +21,50 @@
  */
 
 #include "monitor.h"
+#include "cal_data.h"
+#include "capacity.h"
 #include "ch.h"
+#include "events.h"
 #include "hal.h"
+#include "hid_power.h"
+#include "history.h"
+#include "settings.h"
+#include "trace.h"
+#include "usbcfg.h"
+#include <algorithm>
 #include <array>
+#include <cstdlib>
 #include <numeric>
+#include <utility>
 
 extern msg_t getVoltages(monitor::adc_data_t& voltages);
 
 namespace monitor {
 
-static constexpr uint16_t CUTOFF_DEFAULT = 4100;
+// Initial content of the averaging buffers, per cell
+static constexpr uint16_t CELL_VOLTAGE_SEED = 4100;
 
-// 85% battery charge level by default
-a16_t chargeCutoff = CUTOFF_DEFAULT * 2;
-// 65% battery discharge level by default
-a16_t idleDischargeCutoff = 3750 * 2;
+// The defaults are set by the battery profile
+a16_t chargeCutoff;
+a16_t idleDischargeCutoff;
 
 std::atomic<State> state;
 adc_data_t voltages;
+std::atomic_uint8_t level;
+a16_t runTime{RUN_TIME_UNKNOWN};
+a16_t faults;
+static std::atomic_bool stopRequest;
+static std::atomic_bool stopped;
 
 constexpr sv stateString[] = {"IDLE", "TRICKLE", "DISCHARGE", "CHARGE"};
 
 constexpr uint16_t SWITCH_12V_THRESHOLD = 11900U;
-constexpr uint16_t TRICKLE_HYST = 200U;
+// Below the critical level of the battery profile, reported to the host as the ring indicator
+constexpr uint16_t CRITICAL_HYST = 50U;
+// BAT2-BAT1 difference considered as a balancing fault
+constexpr uint16_t IMBALANCE_LIMIT = 200U;
+// Waited after a power path transition for the VBAT step to settle
+constexpr uint32_t IR_SETTLE_MS = 50;
 
 template<typename T>
 class MovingAverageBuf
@@ -70,7 +91,243 @@ public:
     }
 };
 
-std::array<MovingAverageBuf<uint16_t>, AdcChNumber> maArray{{CUTOFF_DEFAULT, 12000, CUTOFF_DEFAULT * 2}};
+std::array<MovingAverageBuf<uint16_t>, AdcChNumber> maArray{{CELL_VOLTAGE_SEED, 12000, CELL_VOLTAGE_SEED * 2}};
+
+/*
+ * State of charge, fixed point percents (Q8).
+ * The voltage reading of the state curve is used for the load the curve was made with, so the curve
+ * switch on a transition makes the level jump. The IR drop of the actual load is captured instead:
+ * once the averaging settles after a transition, it is the difference between VBAT and the voltage
+ * the new curve expects for the held level. VBAT is compensated by it, the compensation slowly
+ * decays, so the voltage takes over in the long run. The level changes with a limited rate and only
+ * in the direction of the current flow.
+ */
+class SocEstimator
+{
+private:
+    // The averaging buffers are refilled with the samples of the new state
+    static constexpr uint8_t SETTLE_CYCLES = 10;
+    // Time constant of the compensation decay, cycles (~14 min)
+    static constexpr int32_t IR_DECAY = 4096;
+    // 0.5%/s
+    static constexpr int32_t MAX_STEP = (100 << 8) * PERIOD_MS / 200'000;
+    const BatteryProfile* profile_{};
+    int32_t soc_{};
+    // Q8 mV, positive when VBAT is above the curve
+    int32_t irDrop_{};
+    uint8_t settle_{};
+    // No level to hold after the start or the profile switch, the voltage reading is used until it settles
+    bool tracking_{};
+public:
+    uint8_t update(uint16_t vBat, State st, bool transition)
+    {
+        using enum State;
+        if(profile_ != &batteryProfile()) {
+            profile_ = &batteryProfile();
+            tracking_ = true;
+            settle_ = SETTLE_CYCLES;
+        }
+        if(transition) {
+            settle_ = SETTLE_CYCLES;
+        }
+        if(tracking_) {
+            soc_ = capacity::level(vBat, st) << 8;
+            irDrop_ = 0;
+            tracking_ = --settle_ != 0;
+        }
+        else if(settle_) {
+            // The level is held until the load step is fully seen by the averaging
+            if(--settle_ == 0) {
+                irDrop_ = (vBat - capacity::voltage(getLevel(), st)) << 8;
+            }
+        }
+        else {
+            irDrop_ -= irDrop_ / IR_DECAY + (irDrop_ > 0) - (irDrop_ < 0);
+            const auto vComp = static_cast<uint16_t>(std::clamp<int32_t>(vBat - (irDrop_ >> 8), 0, UINT16_MAX));
+            const int32_t step = (capacity::level(vComp, st) << 8) - soc_;
+            soc_ += std::clamp(step, st == Charge || st == Trickle ? 0 : -MAX_STEP, st == Discharge ? 0 : MAX_STEP);
+        }
+        return getLevel();
+    }
+    uint8_t getLevel() const
+    {
+        return static_cast<uint8_t>((soc_ + 128) >> 8);
+    }
+    // Q8 percents
+    uint16_t getSoc() const
+    {
+        return soc_;
+    }
+};
+
+static SocEstimator soc;
+
+/*
+ * Least squares slope of the level over a sliding window, the sums are updated incrementally,
+ * so the cost doesn't depend on the window size. The window restarts on a state change.
+ * The charge is much slower than the discharge, its window is longer to see more than
+ * a couple of the level steps.
+ */
+class RunTimeEstimator
+{
+private:
+    static constexpr size_t WINDOW = 16;
+    // 10 s and 1 min
+    static constexpr uint16_t DISCHARGE_SAMPLE_CYCLES = 10'000 / PERIOD_MS;
+    static constexpr uint16_t CHARGE_SAMPLE_CYCLES = 60'000 / PERIOD_MS;
+    static constexpr uint8_t MIN_POINTS = 4;
+    std::array<uint16_t, WINDOW> buf_;
+    // The oldest point is x = 0
+    int32_t sumY_{};
+    int32_t sumXY_{};
+    uint8_t n_{};
+    uint8_t head_{};
+    uint16_t cycles_{};
+    uint16_t sampleCycles_{};
+    State state_{};
+    uint16_t runTime_{RUN_TIME_UNKNOWN};
+
+    void add(uint16_t y)
+    {
+        if(n_ < WINDOW) {
+            sumXY_ += n_ * y;
+            buf_[n_++] = y;
+        }
+        else {
+            // All the remaining points move one step closer to the origin
+            const uint16_t oldest = buf_[head_];
+            sumXY_ += static_cast<int32_t>(WINDOW - 1) * y - (sumY_ - oldest);
+            sumY_ -= oldest;
+            buf_[head_] = y;
+            head_ = (head_ + 1) % WINDOW;
+        }
+        sumY_ += y;
+    }
+
+    // Seconds for the level to reach the target, the slope must point to it
+    uint16_t estimate(int32_t remaining) const
+    {
+        const int32_t n = n_;
+        const int32_t sumX = n * (n - 1) / 2;
+        const int32_t sumXX = (n - 1) * n * (2 * n - 1) / 6;
+        const int32_t num = n * sumXY_ - sumX * sumY_;
+        const uint32_t den = n * sumXX - sumX * sumX;
+        if(n_ < MIN_POINTS || remaining == 0 || (num < 0) != (remaining < 0) || num == 0) {
+            return RUN_TIME_UNKNOWN;
+        }
+        const uint32_t seconds =
+          static_cast<uint64_t>(std::abs(remaining)) * den * (sampleCycles_ * PERIOD_MS / 1000) / std::abs(num);
+        return std::min<uint32_t>(seconds, RUN_TIME_UNKNOWN - 1);
+    }
+public:
+    uint16_t update(uint16_t soc, State st)
+    {
+        using enum State;
+        if(st != state_) {
+            state_ = st;
+            sampleCycles_ = st == Discharge ? DISCHARGE_SAMPLE_CYCLES : CHARGE_SAMPLE_CYCLES;
+            n_ = head_ = cycles_ = 0;
+            sumY_ = sumXY_ = 0;
+            runTime_ = RUN_TIME_UNKNOWN;
+        }
+        if(cycles_) {
+            --cycles_;
+            return runTime_;
+        }
+        cycles_ = sampleCycles_ - 1;
+        add(soc);
+        if(st == Discharge) {
+            runTime_ = estimate(-soc);
+            // Until the slope is known
+            if(runTime_ == RUN_TIME_UNKNOWN) {
+                runTime_ = capacity::runTime(soc);
+            }
+        }
+        else if(st == Charge || st == Trickle) {
+            runTime_ = estimate((capacity::level(chargeCutoff, st) << 8) - soc);
+        }
+        return runTime_;
+    }
+};
+
+static RunTimeEstimator runTimeEstimator;
+
+/*
+ * Mains presence is reported as DCD, critically low battery during discharge as RI.
+ * DSR is always set while the firmware is running.
+ * The same status is published through the HID Power Device interface.
+ * Returns true while the battery is critically low.
+ */
+static bool notifyHost(State st, uint16_t batVoltage)
+{
+    using enum State;
+    static bool critical;
+    const auto& profile = batteryProfile();
+    const uint16_t criticalLevel = profile.criticalLevel * profile.cells;
+    uint16_t bits = SERIAL_STATE_DSR;
+    if(st != Discharge) {
+        bits |= SERIAL_STATE_DCD;
+        critical = false;
+    }
+    else {
+        critical = batVoltage < criticalLevel + (critical ? CRITICAL_HYST : 0);
+        if(critical) {
+            bits |= SERIAL_STATE_RI;
+        }
+    }
+    usbSetSerialState(bits);
+    hidPowerUpdate({.acPresent = st != Discharge,
+                    .charging = st == Charge || st == Trickle,
+                    .discharging = st == Discharge,
+                    .belowRemainingCapacityLimit = critical,
+                    .shutdownImminent = critical,
+                    .remainingCapacity = level.load(std::memory_order_relaxed),
+                    .remainingCapacityLimit = capacity::level(criticalLevel, Discharge),
+                    .runTimeToEmpty = st == Discharge ? runTime.load(std::memory_order_relaxed) : RUN_TIME_UNKNOWN,
+                    .voltage = batVoltage});
+    return critical;
+}
+
+/*
+ * The power path transitions are load steps, the VBAT step shows the internal resistance.
+ * There is no current sensor: the charger current is fixed, so the charge step is proportional
+ * to the resistance, the trickle current before it is small. The mains loss step depends on the load.
+ * The sample before the step is the one of the current cycle for the charger switched by the firmware,
+ * the one of the previous cycle for the mains loss that has already happened.
+ */
+static void measureIr(State prev, State next, uint16_t lastVBat, uint16_t vBat)
+{
+    using enum State;
+    const bool chargerEnabled = next == Charge && (prev == Idle || prev == Trickle);
+    const bool mainsLost = next == Discharge && prev == Idle;
+    if(!chargerEnabled && !mainsLost) {
+        return;
+    }
+    chThdSleepMilliseconds(IR_SETTLE_MS);
+    adc_data_t burst;
+    if(getVoltages(burst) != MSG_OK) {
+        return;
+    }
+    const int32_t step = chargerEnabled ? burst[AdcVBat] - vBat : lastVBat - burst[AdcVBat];
+    if(step > 0) {
+        history::addIr(chargerEnabled ? history::IrCharge : history::IrLoad, step);
+        events::record(chargerEnabled ? events::IrCharge : events::IrLoad, step);
+    }
+}
+
+static void updateFaults(bool critical)
+{
+    using enum AdcChannels;
+    uint16_t flags = faults & FaultWatchdogReset;
+    if(critical) {
+        flags |= FaultBatteryCritical;
+    }
+    int32_t vBal = voltages[AdcVBat] - voltages[AdcBat1] * batteryProfile().cells;
+    if(vBal > IMBALANCE_LIMIT || vBal < -IMBALANCE_LIMIT) {
+        flags |= FaultImbalance;
+    }
+    faults = flags;
+}
 
 /*
  * Watchdog deadline set to less than 1s (LSI=40000 / (32 * 1000)).
@@ -81,11 +338,19 @@ static const WDGConfig wdgcfg = {
   .winr = STM32_IWDG_WIN_DISABLED,
 };
 
-static THD_WORKING_AREA(MONITOR_WA_SIZE, 128);
+static THD_WORKING_AREA(MONITOR_WA_SIZE, 320);
 THD_FUNCTION(monitorThread, )
 {
     using enum AdcChannels;
+    if(RCC->CSR & RCC_CSR_IWDGRSTF) {
+        faults = FaultWatchdogReset;
+    }
+    events::record(events::Boot, RCC->CSR >> 24);
+    RCC->CSR |= RCC_CSR_RMVF;
     wdgStart(&WDGD1, &wdgcfg);
+    // Minimal VBAT during the discharge
+    uint16_t minVoltage = UINT16_MAX;
+    uint16_t rawVBat{};
     while(true) {
         adc_data_t temp_voltages;
         getVoltages(temp_voltages);
@@ -93,8 +358,21 @@ THD_FUNCTION(monitorThread, )
             maArray[i].add(temp_voltages[i]);
             voltages[i] = maArray[i].getMean();
         }
+        const uint16_t lastRawVBat = std::exchange(rawVBat, temp_voltages[AdcVBat]);
 
+        if(stopRequest) {
+            palClearLine(LINE_CHRG_EN);
+            palClearLine(LINE_TRICKLE_EN);
+            palClearLine(LINE_BAT_EN);
+            stopped = true;
+            wdgReset(&WDGD1);
+            chThdSleepMilliseconds(PERIOD_MS);
+            continue;
+        }
         uint16_t batVoltage = voltages[AdcVBat];
+        const auto& profile = batteryProfile();
+        const uint16_t trickleHyst = profile.trickleHyst * profile.cells;
+        const State prevState = state;
         switch(state) {
             using enum State;
             case Idle:
@@ -106,7 +384,7 @@ THD_FUNCTION(monitorThread, )
                     palSetLine(LINE_BAT_EN);
                     palSetLine(LINE_CHRG_EN);
                 }
-                else if(batVoltage < (chargeCutoff - TRICKLE_HYST)) {
+                else if(batVoltage < (chargeCutoff - trickleHyst)) {
                     state = Trickle;
                     palSetLine(LINE_BAT_EN);
                     palSetLine(LINE_TRICKLE_EN);
@@ -149,13 +427,68 @@ THD_FUNCTION(monitorThread, )
                 };
                 break;
         }
+        const State newState = state;
+        if(newState != prevState) {
+            trace::record(
+              trace::StateChange, to_underlying(prevState) << 4 | to_underlying(newState), batVoltage);
+            trace::record(trace::GpioOutput, 0, palReadLatch(GPIOA));
+            if(newState == State::Discharge) {
+                events::record(events::MainsLost, batVoltage);
+            }
+            else if(prevState == State::Discharge) {
+                events::record(events::MainsRestored, minVoltage);
+                minVoltage = UINT16_MAX;
+            }
+            else {
+                events::record(events::StateChange, to_underlying(prevState) << 4 | to_underlying(newState));
+            }
+            measureIr(prevState, newState, lastRawVBat, rawVBat);
+        }
+        if(state == State::Discharge) {
+            minVoltage = std::min(minVoltage, batVoltage);
+        }
+        history::add(voltages[AdcMain], batVoltage);
+        level.store(soc.update(batVoltage, newState, newState != prevState), std::memory_order_relaxed);
+        runTime.store(runTimeEstimator.update(soc.getSoc(), newState), std::memory_order_relaxed);
+        const bool critical = notifyHost(state, batVoltage);
+        capacity::update(newState, soc.getLevel(), batVoltage, critical);
+        updateFaults(critical);
         wdgReset(&WDGD1);
-        chThdSleepMilliseconds(200);
+        chThdSleepMilliseconds(PERIOD_MS);
     }
 }
 
+void stop()
+{
+    stopRequest = true;
+    while(!stopped) {
+        chThdSleepMilliseconds(10);
+    }
+}
+
+bool setProfile(size_t index)
+{
+    if(!selectBatteryProfile(index)) {
+        return false;
+    }
+    const auto& profile = batteryProfile();
+    chargeCutoff = profile.chargeCutoff * profile.cells;
+    idleDischargeCutoff = profile.idleDischargeCutoff * profile.cells;
+    return true;
+}
+
 void run()
 {
+    if(!setProfile(settings::read(settings::Profile).value_or(0))) {
+        setProfile(0);
+    }
+    if(const auto saved = settings::read(settings::ChargeCutoff)) {
+        chargeCutoff = *saved;
+    }
+    if(const auto saved = settings::read(settings::IdleDischargeCutoff)) {
+        idleDischargeCutoff = *saved;
+    }
+    capacity::load();
     auto* thd = chThdCreateStatic(MONITOR_WA_SIZE, sizeof(MONITOR_WA_SIZE), NORMALPRIO + 1, monitorThread, nullptr);
     chRegSetThreadNameX(thd, "monitor");
 }
@@ -24,6 +24,8 @@
 #define MONITOR_H
 
 #include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <string_view>
 #include <utility>
 
@@ -37,9 +39,8 @@ using adc_data_t = a16_t[AdcChNumber];
 using std::to_underlying;
 using sv = std::string_view;
 
-// 85% battery charge by default;
+// Battery voltage limits, mV. The defaults are set by the battery profile
 extern a16_t chargeCutoff;
-// 55% battery charge by default
 extern a16_t idleDischargeCutoff;
 
 enum class State : uint16_t { Idle, Trickle, Discharge, Charge };
@@ -50,14 +51,36 @@ static inline sv toString(decltype(state)& state)
     return stateString[to_underlying(state.load(std::memory_order_relaxed))];
 }
 
-static inline sv toString(State& st)
+static inline sv toString(State st)
 {
     return stateString[to_underlying(st)];
 }
 
 extern adc_data_t voltages;
+// Battery level in percents, estimated once per period from VBAT compensated for the load step
+// of the last transition, continuous across the transitions
+extern std::atomic_uint8_t level;
+// Predicted seconds to empty during discharge, to the charge cutoff during charge, updated once per period
+extern a16_t runTime;
+constexpr uint16_t RUN_TIME_UNKNOWN = UINT16_MAX;
 
+// Fault flags, the watchdog reset flag is kept until the next reset
+enum Faults : uint16_t {
+    FaultWatchdogReset = 0x01,
+    FaultBatteryCritical = 0x02,
+    FaultImbalance = 0x04,
+};
+extern a16_t faults;
+
+// The state and the voltages are updated with this period
+constexpr uint32_t PERIOD_MS = 200;
+
+// Loads the saved battery profile and limits, starts the thread
 void run();
+// Switches the battery profile, the limits are reset to its defaults
+bool setProfile(size_t index);
+// Disables the charging paths and stops the state machine, returns when the outputs are off
+void stop();
 
 } // data
 
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "rt_stats.h"
+#include "hal.h"
+
+namespace stats {
+
+static constexpr uint32_t COUNTER_MASK = SysTick_LOAD_RELOAD_Msk;
+
+// Down counting SysTick value captured at the last accounting point
+static uint32_t lastStamp;
+static uint32_t irqEnterStamp;
+static uint32_t irqNesting;
+static uint64_t irqCycles;
+static uint32_t irqCount;
+
+static inline uint32_t elapsedSince(uint32_t& stamp)
+{
+    uint32_t now = SysTick->VAL;
+    uint32_t elapsed = (stamp - now) & COUNTER_MASK;
+    stamp = now;
+    return elapsed;
+}
+
+void init()
+{
+    // The counter wraps every ~350ms at 48MHz, the monitor thread wakes up more often than that,
+    // so there is always a context switch in between
+    SysTick->LOAD = COUNTER_MASK;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+    lastStamp = SysTick->VAL;
+}
+
+Sample collect(thread_t* tp)
+{
+    chSysLock();
+    // Account the time consumed by the caller so far
+    if(tp == chThdGetSelfX()) {
+        tp->stats_cycles += elapsedSince(lastStamp);
+    }
+    Sample result{tp->stats_cycles, tp->stats_switches};
+    tp->stats_cycles = 0;
+    tp->stats_switches = 0;
+    chSysUnlock();
+    return result;
+}
+
+Sample collectIsr()
+{
+    chSysLock();
+    Sample result{irqCycles, irqCount};
+    irqCycles = 0;
+    irqCount = 0;
+    chSysUnlock();
+    return result;
+}
+
+size_t getStackFree(thread_t* tp)
+{
+    const auto* base = reinterpret_cast<const uint8_t*>(chThdGetWorkingAreaX(tp));
+    const auto* p = base;
+    while(*p == CH_DBG_STACK_FILL_VALUE) {
+        ++p;
+    }
+    return p - base;
+}
+
+} // stats
+
+using namespace stats;
+
+// Called by the kernel with interrupts disabled
+extern "C" void rtStatsSwitchHook(thread_t* ntp, thread_t* otp)
+{
+    otp->stats_cycles += elapsedSince(lastStamp);
+    ++ntp->stats_switches;
+}
+
+extern "C" void rtStatsIrqEnterHook()
+{
+    if(irqNesting++ == 0) {
+        irqEnterStamp = SysTick->VAL;
+    }
+}
+
+extern "C" void rtStatsIrqLeaveHook()
+{
+    if(--irqNesting == 0) {
+        uint32_t elapsed = elapsedSince(irqEnterStamp);
+        irqCycles += elapsed;
+        ++irqCount;
+        // Exclude the handler time from the share of the interrupted thread
+        lastStamp = (lastStamp - elapsed) & COUNTER_MASK;
+    }
+}
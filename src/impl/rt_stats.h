@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef RT_STATS_H
+#define RT_STATS_H
+
+#include "ch.h"
+
+namespace stats {
+
+// CPU time is accounted in core clock cycles using the SysTick counter,
+// which is free because the kernel runs tickless on TIM3
+struct Sample
+{
+    uint64_t cycles;
+    uint32_t switches;
+};
+
+void init();
+
+// Returns the thread counters accumulated since the previous call and restarts them
+Sample collect(thread_t* tp);
+// Same for the time spent in the interrupt handlers, switches field holds the IRQ count
+Sample collectIsr();
+
+// Stack space never touched since the thread start, scanned from the working area base
+size_t getStackFree(thread_t* tp);
+
+} // stats
+
+#endif // RT_STATS_H
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "settings.h"
+#include "ch.h"
+#include "crc16.h"
+#include "flash.h"
+#include <array>
+
+namespace settings {
+
+/*
+ * Log-structured store in two flash pages, reserved in the firmware image and erased after the flashing.
+ * Every write appends a record to the active page, the last valid record of the key wins.
+ * When the page is full the latest values are moved to the other page, so the pages are erased in turn.
+ * The header record with the incremented generation is programmed last and makes the page active.
+ * Records broken by a power loss fail the CRC check and are skipped.
+ */
+struct Record
+{
+    uint16_t key;
+    uint16_t crc;
+    uint32_t value;
+};
+static_assert(sizeof(Record) == 8);
+
+static constexpr size_t PAGES = 2;
+static constexpr size_t RECORDS = flash::PAGE_SIZE / sizeof(Record);
+static constexpr uint16_t HEADER_KEY = 0x5354;
+static constexpr uint16_t ERASED = 0xFFFF;
+
+using page_t = std::array<Record, RECORDS>;
+
+alignas(flash::PAGE_SIZE) static constinit const std::array<page_t, PAGES> pages = [] {
+    std::array<page_t, PAGES> result;
+    for(auto& page : result) {
+        page.fill({ERASED, ERASED, UINT32_MAX});
+    }
+    return result;
+}();
+
+static MUTEX_DECL(mutex);
+// Index of the active page, PAGES until the first write to the blank store
+static size_t active = PAGES;
+static bool initialized;
+
+// The page content is changed at runtime
+static Record readRecord(size_t page, size_t index)
+{
+    const auto* record = reinterpret_cast<const volatile uint16_t*>(&pages[page][index]);
+    return {record[0], record[1], record[2] | static_cast<uint32_t>(record[3]) << 16};
+}
+
+static uint16_t crc(const Record& record)
+{
+    const uint8_t data[]{static_cast<uint8_t>(record.key),
+                         static_cast<uint8_t>(record.key >> 8),
+                         static_cast<uint8_t>(record.value),
+                         static_cast<uint8_t>(record.value >> 8),
+                         static_cast<uint8_t>(record.value >> 16),
+                         static_cast<uint8_t>(record.value >> 24)};
+    return Utils::crc16(data, sizeof(data));
+}
+
+static bool isValid(const Record& record)
+{
+    return record.crc == crc(record);
+}
+
+static bool isErased(const Record& record)
+{
+    return record.key == ERASED && record.crc == ERASED && record.value == UINT32_MAX;
+}
+
+static bool program(size_t page, size_t index, Record record)
+{
+    record.crc = crc(record);
+    const uint16_t halfwords[]{record.key,
+                               record.crc,
+                               static_cast<uint16_t>(record.value),
+                               static_cast<uint16_t>(record.value >> 16)};
+    const auto* dest = reinterpret_cast<const volatile uint16_t*>(&pages[page][index]);
+    return flash::Flash::Write(dest, halfwords, std::size(halfwords));
+}
+
+static void init()
+{
+    uint32_t generation{};
+    for(size_t page{}; page < PAGES; ++page) {
+        const Record header = readRecord(page, 0);
+        if(header.key == HEADER_KEY && isValid(header) && (active == PAGES || header.value > generation)) {
+            active = page;
+            generation = header.value;
+        }
+    }
+    initialized = true;
+}
+
+static size_t firstFree(size_t page)
+{
+    size_t i = 1;
+    while(i < RECORDS && !isErased(readRecord(page, i))) {
+        ++i;
+    }
+    return i;
+}
+
+static std::optional<uint32_t> find(size_t page, Key key)
+{
+    std::optional<uint32_t> result;
+    for(size_t i = 1; i < RECORDS; ++i) {
+        const Record record = readRecord(page, i);
+        if(isErased(record)) {
+            break;
+        }
+        if(record.key == key && isValid(record)) {
+            result = record.value;
+        }
+    }
+    return result;
+}
+
+// Moves the latest values to the other page and makes it active
+static bool compact()
+{
+    const size_t target = active == PAGES ? 0 : (active + 1) % PAGES;
+    const uint32_t generation = active == PAGES ? 0 : readRecord(active, 0).value;
+    if(!flash::Flash::ErasePage(&pages[target])) {
+        return false;
+    }
+    size_t index = 1;
+    if(active != PAGES) {
+        for(uint8_t key{}; key < KeysNumber; ++key) {
+            if(const auto value = find(active, static_cast<Key>(key))) {
+                if(!program(target, index++, {key, 0, *value})) {
+                    return false;
+                }
+            }
+        }
+    }
+    if(!program(target, 0, {HEADER_KEY, 0, generation + 1})) {
+        return false;
+    }
+    active = target;
+    return true;
+}
+
+std::optional<uint32_t> read(Key key)
+{
+    chMtxLock(&mutex);
+    if(!initialized) {
+        init();
+    }
+    std::optional<uint32_t> result;
+    if(active != PAGES) {
+        result = find(active, key);
+    }
+    chMtxUnlock(&mutex);
+    return result;
+}
+
+bool write(Key key, uint32_t value)
+{
+    if(read(key) == value) {
+        return true;
+    }
+    chMtxLock(&mutex);
+    size_t index = active == PAGES ? RECORDS : firstFree(active);
+    bool result = true;
+    if(index == RECORDS) {
+        result = compact();
+        index = result ? firstFree(active) : RECORDS;
+    }
+    result = result && program(active, index, {key, 0, value});
+    chMtxUnlock(&mutex);
+    return result;
+}
+
+} // settings
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <cstdint>
+#include <optional>
+
+namespace settings {
+
+enum Key : uint8_t {
+    Profile,
+    ChargeCutoff,
+    IdleDischargeCutoff,
+    // Indexed by monitor::AdcChannels
+    Calibration,
+    // Learned by the capacity module: the cycles count and the full run time, then the discharge curve offsets
+    LearnedRunTime = Calibration + 3,
+    CurveCorrection,
+    KeysNumber = CurveCorrection + 3
+};
+
+std::optional<uint32_t> read(Key key);
+// Writing the value equal to the stored one doesn't touch the flash
+bool write(Key key, uint32_t value);
+
+} // settings
+
+#endif // SETTINGS_H
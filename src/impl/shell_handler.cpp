@@ -28,83 +28,212 @@
 
 #include "shell_handler.h"
 #include "cal_data.h"
+#include "capacity.h"
+#include "events.h"
+#include "history.h"
 #include "monitor.h"
+#include "rt_stats.h"
+#include "settings.h"
+#include "stream_handler.h"
+#include "telemetry.h"
+#include "trace.h"
 #include "usbcfg.h"
+#include "version.h"
+#include <algorithm>
 #include <cstdlib>
-#include <ranges>
+#include <cstring>
+#include <string_view>
 
 static void cmd_poll(BaseSequentialStream* chp, int argc, char* argv[]);
 static void cmd_cutoff_charge(BaseSequentialStream* chp, int argc, char* argv[]);
 static void cmd_cutoff_discharge(BaseSequentialStream* chp, int argc, char* argv[]);
 static void print_cutoff(BaseSequentialStream* chp, int argc, char* argv[]);
+static void cmd_stats(BaseSequentialStream* chp, int argc, char* argv[]);
+static void cmd_trace(BaseSequentialStream* chp, int argc, char* argv[]);
+static void cmd_stream_bin(BaseSequentialStream* chp, int argc, char* argv[]);
+static void cmd_stream(BaseSequentialStream* chp, int argc, char* argv[]);
+static void cmd_stream_delta(BaseSequentialStream* chp, int argc, char* argv[]);
+static void cmd_status(BaseSequentialStream* chp, int argc, char* argv[]);
+static void cmd_machine(BaseSequentialStream* chp, int argc, char* argv[]);
+static void cmd_dfu(BaseSequentialStream* chp, int argc, char* argv[]);
+static void cmd_profile(BaseSequentialStream* chp, int argc, char* argv[]);
+static void cmd_calibrate(BaseSequentialStream* chp, int argc, char* argv[]);
+static void cmd_events(BaseSequentialStream* chp, int argc, char* argv[]);
+static void cmd_history(BaseSequentialStream* chp, int argc, char* argv[]);
+static void cmd_time_sync(BaseSequentialStream* chp, int argc, char* argv[]);
+static void cmd_capacity(BaseSequentialStream* chp, int argc, char* argv[]);
+static void cmd_ir(BaseSequentialStream* chp, int argc, char* argv[]);
 
-static const ShellCommand commands[] = {{"poll", cmd_poll},
-                                        {"limit-charge", cmd_cutoff_charge},
-                                        {"limit-discharge", cmd_cutoff_discharge},
-                                        {"limits", print_cutoff},
+// Records the command invocation in the trace ring, the index is the position in the table
+template<uint8_t index, shellcmd_t cmd>
+static void traced(BaseSequentialStream* chp, int argc, char* argv[])
+{
+    trace::record(trace::ShellCommand, index, argc);
+    cmd(chp, argc, argv);
+}
+
+static const ShellCommand commands[] = {{"poll", traced<0, cmd_poll>},
+                                        {"limit-charge", traced<1, cmd_cutoff_charge>},
+                                        {"limit-discharge", traced<2, cmd_cutoff_discharge>},
+                                        {"limits", traced<3, print_cutoff>},
+                                        {"stats", traced<4, cmd_stats>},
+                                        {"trace", traced<5, cmd_trace>},
+                                        {"stream-bin", traced<6, cmd_stream_bin>},
+                                        {"stream", traced<7, cmd_stream>},
+                                        {"stream-delta", traced<8, cmd_stream_delta>},
+                                        {"status", traced<9, cmd_status>},
+                                        {"machine", traced<10, cmd_machine>},
+                                        {"dfu", traced<11, cmd_dfu>},
+                                        {"profile", traced<12, cmd_profile>},
+                                        {"calibrate", traced<13, cmd_calibrate>},
+                                        {"events", traced<14, cmd_events>},
+                                        {"history", traced<15, cmd_history>},
+                                        {"time-sync", traced<16, cmd_time_sync>},
+                                        {"capacity", traced<17, cmd_capacity>},
+                                        {"ir", traced<18, cmd_ir>},
                                         {nullptr, nullptr}};
 static char histbuf[128];
 static const ShellConfig shell_cfg = {(BaseSequentialStream*)&SDU1, commands, histbuf, 128};
 constexpr char CTRL_C = 0x03;
+constexpr char CTRL_D = 0x04;
+
+// Set on invalid arguments, reported as the command status in machine mode
+static bool commandFailed;
+
+static void usage(BaseSequentialStream* chp, const char* message)
+{
+    commandFailed = true;
+    shellUsage(chp, message);
+}
+
+// Returns true if CTRL-C has been received during the period
+static bool interruptedWithin(BaseSequentialStream* chp, sysinterval_t period)
+{
+    auto* asyncCh = (BaseAsynchronousChannel*)chp;
+    if(auto msg = chnGetTimeout(asyncCh, period); msg == CTRL_C) {
+        return true;
+    }
+    else if(msg != MSG_TIMEOUT && period != TIME_IMMEDIATE) {
+        chThdSleep(period);
+    }
+    return false;
+}
 
-static uint32_t convertVoltage2Percents(uint32_t val, const bat_lut_t& lut)
+// Accumulates the samples to be written by whole USB packets, reduces the transactions count at high rates.
+// The output never blocks, see telemetry::Writer
+class PacketBatch
 {
-    using namespace std;
-    if(val <= lut.front().first) {
-        return 0;
+private:
+    static constexpr size_t PACKET_SIZE = telemetry::Writer::MAX_SIZE;
+    telemetry::Writer writer_;
+    uint8_t buf_[PACKET_SIZE];
+    size_t len_{};
+    uint8_t count_{};
+    const uint8_t limit_;
+public:
+    PacketBatch(BaseSequentialStream* chp, uint8_t limit) : writer_{(SerialUSBDriver*)chp}, limit_{limit}
+    { }
+    ~PacketBatch()
+    {
+        writer_.discard();
+    }
+    void put(const void* data, size_t len)
+    {
+        if(len_ + len > PACKET_SIZE) {
+            flush();
+        }
+        memcpy(&buf_[len_], data, len);
+        len_ += len;
+        if(++count_ >= limit_) {
+            flush();
+        }
     }
-    if(val >= lut.back().first) {
-        return 100;
+    void flush()
+    {
+        if(len_) {
+            writer_.write(buf_, len_, count_);
+        }
+        len_ = count_ = 0;
     }
+};
+
+struct StreamParams
+{
+    sysinterval_t period;
+    uint8_t batch;
+};
 
-    const auto result = ranges::find_if(lut, [val](auto entry) { return entry.first > val; });
-    const auto [v2, p2] = *result;
-    const auto prev = result - 1;
-    const auto [v1, p1] = *prev;
-    auto percent_offset = 10 * (val - v1) * (p2 - p1) / (v2 - v1);
-    return p1 + (percent_offset + 5) / 10;
+// Parses optional [period_ms [batch]] arguments, returns false if they are out of range
+static bool parseStreamParams(int argc, char* argv[], StreamParams& params)
+{
+    constexpr uint32_t MAX_PERIOD_MS = 60000;
+    constexpr uint32_t MAX_BATCH = 8;
+    uint32_t periodMs = argc > 0 ? atoi(argv[0]) : 1000;
+    uint32_t batch = argc > 1 ? atoi(argv[1]) : 1;
+    if(argc > 2 || periodMs < monitor::PERIOD_MS || periodMs > MAX_PERIOD_MS || !batch || batch > MAX_BATCH) {
+        return false;
+    }
+    params = {TIME_MS2I(periodMs), static_cast<uint8_t>(batch)};
+    return true;
 }
 
-static uint32_t convertPercents2Voltage(uint32_t val, const bat_lut_t& lut)
+// The system time wraps every 6.5s (16 bit at 10kHz), longer waits are split
+static constexpr sysinterval_t MAX_WAIT = TIME_MS2I(5000);
+
+// Returns true if CTRL-C has been received before the deadline
+static bool interruptedUntil(BaseSequentialStream* chp, systimestamp_t deadline)
 {
-    using namespace std;
-    auto result = ranges::find_if(lut, [val](auto entry) { return entry.second > val; });
-    const auto [v2, p2] = *result;
-    const auto prev = result - 1;
-    const auto [v1, p1] = *prev;
-    auto volt_offset = 10 * (val - p1) * (v2 - v1) / (p2 - p1);
-    return v1 + (volt_offset + 5) / 10;
+    do {
+        const systimestamp_t now = chVTGetTimeStamp();
+        const sysinterval_t wait = now < deadline ? std::min<systimestamp_t>(deadline - now, MAX_WAIT) : TIME_IMMEDIATE;
+        if(interruptedWithin(chp, wait)) {
+            return true;
+        }
+    } while(chVTGetTimeStamp() < deadline);
+    return false;
 }
 
-void cmd_poll(BaseSequentialStream* chp, int argc, char* /*argv*/[])
+// Calls the sampler every period until CTRL-C, the period doesn't drift with the output time
+template<typename Sampler>
+static void streamSamples(BaseSequentialStream* chp, const StreamParams& params, Sampler sampler)
 {
-    if(!argc) {
-        using namespace monitor;
-        using enum State;
-        auto* asyncCh = (BaseAsynchronousChannel*)chp;
-        while(true) {
-            uint16_t vBat = voltages[AdcVBat].load(std::memory_order_relaxed);
-            auto vBal = vBat - (voltages[AdcBat1].load(std::memory_order_relaxed) * 2);
-            auto percents = convertVoltage2Percents(vBat, (state == Discharge) ? DISCHARGE_LUT : CHARGE_LUT);
-            chprintf(
-              chp, "%u  %u  %d  %u  %s\r\n", (uint16_t)voltages[AdcMain], vBat, vBal, percents, toString(state).data());
-            if(auto msg = chnGetTimeout(asyncCh, TIME_S2I(1)); msg == CTRL_C) {
-                break;
-            }
-            else if(msg != MSG_TIMEOUT) {
-                chThdSleepSeconds(1);
-            }
+    PacketBatch batch{chp, params.batch};
+    // 64 bit, the period may exceed the system time range
+    systimestamp_t deadline = chVTGetTimeStamp();
+    do {
+        sampler(batch);
+        deadline += params.period;
+        if(const systimestamp_t now = chVTGetTimeStamp(); now > deadline) {
+            // Overrun, restart the schedule from now
+            deadline = now;
         }
+    } while(!interruptedUntil(chp, deadline));
+    batch.flush();
+}
+
+void cmd_poll(BaseSequentialStream* chp, int argc, char* argv[])
+{
+    if(StreamParams params; parseStreamParams(argc, argv, params)) {
+        streamSamples(chp, params, [](PacketBatch& batch) {
+            char line[telemetry::LINE_MAX_SIZE];
+            batch.put(line, telemetry::formatLine(telemetry::takeSample(), line));
+        });
     }
     else {
-        shellUsage(chp,
-                   "Continuously reports Main(Output/Input), VBAT, BAT2-BAT1 difference voltages\r\n"
-                   "  in mV, battery level % and the current state\r\n  Press CTRL-C to exit");
+        usage(chp,
+              "poll [period_ms [batch]]\r\n"
+              "  Continuously reports the tick (1/10000 s), Main(Output/Input), VBAT,\r\n"
+              "  BAT2-BAT1 difference voltages in mV, battery level %, predicted time to empty\r\n"
+              "  or to full (s, 65535 if unknown) and the current state\r\n"
+              "  period_ms: 200-60000, 1000 by default\r\n"
+              "  batch: up to 8 samples sent in a single USB packet, 1 by default\r\n"
+              "  Press CTRL-C to exit");
     }
 }
 
 static void cutoff(monitor::State what,
                    std::atomic_uint16_t& cutoffVal,
+                   settings::Key key,
                    BaseSequentialStream* chp,
                    int argc,
                    char* argv[])
@@ -112,36 +241,39 @@ static void cutoff(monitor::State what,
     using enum monitor::State;
     constexpr auto minPercent = 50;
     constexpr auto maxPercent = 100;
-    const auto& lut = (what == Charge ? CHARGE_LUT : DISCHARGE_LUT);
     do {
         if(argc == 1) {
             uint32_t val = atoi(argv[0]);
             if(minPercent <= val && val <= maxPercent) {
-                val = convertPercents2Voltage(val, lut);
+                val = batteryVoltage(val, what);
             }
             else {
                 chprintf(chp, "The value is not in valid range\r\n");
                 break;
             }
-            chprintf(chp, "Per element: %umV, Battery: %umV\r\n", val / 2, val);
+            chprintf(chp, "Per element: %umV, Battery: %umV\r\n", val / batteryProfile().cells, val);
             cutoffVal = val;
+            if(!settings::write(key, val)) {
+                commandFailed = true;
+                chprintf(chp, "Saving failed, the limit is active until reset\r\n");
+            }
             return;
         }
     } while(false);
     chprintf(chp, "Limits %s %s level\r\n", what == Discharge ? "IDLE" : "", toString(what));
-    shellUsage(chp,
-               "Set cut-off battery level in percents.\r\n"
-               "  The input value must be in the range 50-100\r\n");
+    usage(chp,
+          "Set cut-off battery level in percents.\r\n"
+          "  The input value must be in the range 50-100\r\n");
 }
 
 static void cmd_cutoff_charge(BaseSequentialStream* chp, int argc, char* argv[])
 {
-    cutoff(monitor::State::Charge, monitor::chargeCutoff, chp, argc, argv);
+    cutoff(monitor::State::Charge, monitor::chargeCutoff, settings::ChargeCutoff, chp, argc, argv);
 }
 
 static void cmd_cutoff_discharge(BaseSequentialStream* chp, int argc, char* argv[])
 {
-    cutoff(monitor::State::Discharge, monitor::idleDischargeCutoff, chp, argc, argv);
+    cutoff(monitor::State::Discharge, monitor::idleDischargeCutoff, settings::IdleDischargeCutoff, chp, argc, argv);
 }
 
 static void print_cutoff(BaseSequentialStream* chp, int /*argc*/, char* /*argv*/[])
@@ -152,7 +284,447 @@ static void print_cutoff(BaseSequentialStream* chp, int /*argc*/, char* /*argv*/
              monitor::idleDischargeCutoff.load());
 }
 
-static THD_WORKING_AREA(SHELL_WA_SIZE, 512);
+static void cmd_status(BaseSequentialStream* chp, int argc, char* /*argv*/[])
+{
+    if(argc) {
+        usage(chp,
+              "Reports voltages (mV), battery level, predicted time to empty or to full (s, 65535 if\r\n"
+              "  unknown), state, limits (mV), uptime (s), firmware version,\r\n"
+              "  fault flags (see monitor.h), the telemetry samples dropped because the host\r\n"
+              "  doesn't read them and the host epoch (s, 0 until time-sync), in a single key=value line");
+        return;
+    }
+    auto [tick, vMain, vBat, vBal, percents, st, runTime] = telemetry::takeSample();
+    chprintf(chp,
+             "vmain=%u vbat=%u vbal=%d level=%u runtime=%u state=%s limit_charge=%u limit_discharge=%u uptime=%u "
+             "fw=%x.%02x faults=0x%02x dropped=%u epoch=%u\r\n",
+             vMain,
+             vBat,
+             vBal,
+             percents,
+             runTime,
+             monitor::toString(st).data(),
+             monitor::chargeCutoff.load(),
+             monitor::idleDischargeCutoff.load(),
+             static_cast<uint32_t>(chVTGetTimeStamp() / CH_CFG_ST_FREQUENCY),
+             FIRMWARE_VERSION >> 8,
+             FIRMWARE_VERSION & 0xFF,
+             monitor::faults.load(),
+             telemetry::droppedSamples(),
+             telemetry::epochSeconds());
+}
+
+static void cmd_dfu(BaseSequentialStream* chp, int argc, char* /*argv*/[])
+{
+    if(argc) {
+        usage(chp,
+              "Disables charging, disconnects USB and restarts into the system DFU bootloader\r\n"
+              "  for the firmware update, e.g. dfu-util -a 0 -s 0x08000000:leave -D ups.bin\r\n"
+              "  Not available during discharge");
+        return;
+    }
+    if(monitor::state == monitor::State::Discharge) {
+        commandFailed = true;
+        chprintf(chp, "Not available during discharge\r\n");
+        return;
+    }
+    chprintf(chp, "Starting the bootloader\r\n");
+    // Lets the reply go out
+    chThdSleepMilliseconds(100);
+    monitor::stop();
+    usbDisconnectBus(serusbcfg.usbp);
+    // The host must see the disconnection before the bootloader connects again
+    chThdSleepMilliseconds(200);
+    boardStartBootloader();
+}
+
+static void cmd_profile(BaseSequentialStream* chp, int argc, char* argv[])
+{
+    if(argc == 1) {
+        char* end;
+        const auto index = strtoul(argv[0], &end, 10);
+        if(*end == '\0' && monitor::setProfile(index)) {
+            // The saved limits of the previous profile are replaced by the defaults, the learned data is forgotten
+            if(!settings::write(settings::Profile, index) ||
+               !settings::write(settings::ChargeCutoff, monitor::chargeCutoff) ||
+               !settings::write(settings::IdleDischargeCutoff, monitor::idleDischargeCutoff) || !capacity::reset()) {
+                commandFailed = true;
+                chprintf(chp, "Saving failed, the profile is active until reset\r\n");
+            }
+            print_cutoff(chp, 0, nullptr);
+            return;
+        }
+    }
+    else if(argc == 0) {
+        const auto& active = batteryProfile();
+        for(size_t i{}; i < BATTERY_PROFILES.size(); ++i) {
+            const auto& profile = BATTERY_PROFILES[i];
+            chprintf(chp,
+                     "%c%u %s %uS, limits %u/%umV per element\r\n",
+                     &profile == &active ? '*' : ' ',
+                     i,
+                     profile.name,
+                     profile.cells,
+                     profile.chargeCutoff,
+                     profile.idleDischargeCutoff);
+        }
+        return;
+    }
+    usage(chp,
+          "profile [index]\r\n"
+          "  Lists the battery profiles, the active one is marked with '*'\r\n"
+          "  index: selects and saves the profile, the limits are reset to its defaults,\r\n"
+          "  the learned capacity is forgotten");
+}
+
+static void cmd_calibrate(BaseSequentialStream* chp, int argc, char* argv[])
+{
+    using namespace monitor;
+    constexpr sv channels[AdcChNumber] = {"bat1", "main", "vbat"};
+    if(argc == 2) {
+        const auto channel = std::ranges::find(channels, sv{argv[0]}) - std::begin(channels);
+        const uint32_t actual = atoi(argv[1]);
+        const uint32_t measured = channel < AdcChNumber ? voltages[channel].load() : 0;
+        if(measured && actual) {
+            const uint32_t val = (calibration[channel] * actual + measured / 2) / measured;
+            // Within 10% of the default, larger corrections point to a wrong reference or a board fault
+            if(val * 10 >= CAL_DATA[channel] * 9U && val * 10 <= CAL_DATA[channel] * 11U) {
+                calibration[channel] = val;
+                if(!settings::write(static_cast<settings::Key>(settings::Calibration + channel), val)) {
+                    commandFailed = true;
+                    chprintf(chp, "Saving failed, the calibration is active until reset\r\n");
+                }
+                chprintf(chp, "%s: %u -> %umV, factor %u\r\n", argv[0], measured, actual, val);
+                return;
+            }
+            chprintf(chp, "The correction is out of range\r\n");
+        }
+    }
+    else if(argc == 0) {
+        for(size_t i{}; i < AdcChNumber; ++i) {
+            chprintf(chp, "%s: %umV, factor %u\r\n", channels[i].data(), voltages[i].load(), calibration[i].load());
+        }
+        return;
+    }
+    usage(chp,
+          "calibrate [bat1|main|vbat <mV>]\r\n"
+          "  Lists the channel voltages and calibration factors\r\n"
+          "  mV: the voltage measured with a reference meter, the factor is corrected and saved");
+}
+
+static void cmd_events(BaseSequentialStream* chp, int argc, char* argv[])
+{
+    if(argc <= 1) {
+        char* end = nullptr;
+        const uint32_t cursor = argc ? strtoul(argv[0], &end, 10) : 0;
+        if(!end || *end == '\0') {
+            events::dump(chp, cursor);
+            return;
+        }
+    }
+    usage(chp,
+          "events [cursor]\r\n"
+          "  Prints the power events kept in flash: cursor uptime_s event value\r\n"
+          "  boot: reset flags (RCC_CSR >> 24), mains-lost: VBAT mV,\r\n"
+          "  mains-restored: minimal VBAT mV, state: previous << 4 | new\r\n"
+          "  The last line next=<cursor> is the argument to fetch only the newer events");
+}
+
+static void cmd_history(BaseSequentialStream* chp, int argc, char* /*argv*/[])
+{
+    if(argc) {
+        usage(chp,
+              "Prints the aggregated history, the oldest first:\r\n"
+              "  15m and 1m buckets for the last 12 hours and 30 minutes\r\n"
+              "  level start_uptime_s vbat_min vbat_mean vbat_max main_min (mV)");
+        return;
+    }
+    history::dump(chp);
+}
+
+static void cmd_time_sync(BaseSequentialStream* chp, int argc, char* argv[])
+{
+    if(argc == 1) {
+        char* end;
+        const uint64_t epochMs = strtoull(argv[0], &end, 10);
+        if(*end == '\0' && epochMs) {
+            const uint32_t tick = telemetry::setEpoch(epochMs);
+            events::recordTimeSync(epochMs / 1000);
+            chprintf(chp, "tick=%u\r\n", tick);
+            return;
+        }
+    }
+    usage(chp,
+          "time-sync <epoch_ms>\r\n"
+          "  Binds the host time to the current tick, reported as tick=<tick>.\r\n"
+          "  The telemetry is stamped with ticks (1/10000 s), the sync is saved in the event log");
+}
+
+static void cmd_ir(BaseSequentialStream* chp, int argc, char* /*argv*/[])
+{
+    if(argc) {
+        usage(chp,
+              "VBAT steps (mV) of the power path transitions, the internal resistance proxy:\r\n"
+              "  charge - the charger enabled from IDLE or TRICKLE, the charger current is fixed\r\n"
+              "  load - the mains lost in IDLE, depends on the load\r\n"
+              "  Reports the moving average and the count of every kind since the start, then the latest\r\n"
+              "  steps: kind uptime_s step, the oldest first. All the steps are saved in the event log");
+        return;
+    }
+    history::dumpIr(chp);
+}
+
+static void cmd_capacity(BaseSequentialStream* chp, int argc, char* argv[])
+{
+    if(argc == 0) {
+        capacity::dump(chp);
+        return;
+    }
+    if(argc == 1 && std::string_view{argv[0]} == "reset") {
+        if(!capacity::reset()) {
+            commandFailed = true;
+            chprintf(chp, "Saving failed\r\n");
+        }
+        return;
+    }
+    usage(chp,
+          "capacity [reset]\r\n"
+          "  Reports the data learned from the discharges started charged (>=90%) and ended at\r\n"
+          "  the critical level, a constant load is assumed: the cycles count, the run time of\r\n"
+          "  the full charge (s) and the correction of the discharge curve (mV) every 10%\r\n"
+          "  reset: forgets the learned data, e.g. after the battery replacement");
+}
+
+static void cmd_stats(BaseSequentialStream* chp, int argc, char* /*argv*/[])
+{
+    if(argc) {
+        usage(chp,
+              "Reports free stack bytes, CPU load and context switches per thread\r\n"
+              "  accumulated since the previous call");
+        return;
+    }
+    constexpr size_t MAX_THREADS = 8;
+    struct
+    {
+        const char* name;
+        size_t stackFree;
+        stats::Sample sample;
+    } threads[MAX_THREADS];
+    size_t count{};
+    uint64_t total{};
+    for(auto* tp = chRegFirstThread(); tp != nullptr; tp = chRegNextThread(tp)) {
+        if(count < MAX_THREADS) {
+            auto& entry = threads[count++];
+            entry = {chRegGetThreadNameX(tp), stats::getStackFree(tp), stats::collect(tp)};
+            total += entry.sample.cycles;
+        }
+    }
+    auto isr = stats::collectIsr();
+    total += isr.cycles;
+    auto permille = [total](uint64_t cycles) { return static_cast<uint32_t>(total ? cycles * 1000 / total : 0); };
+    chprintf(chp, "thread   stack  cpu%%  switches\r\n");
+    for(size_t i{}; i < count; ++i) {
+        const auto& [name, stackFree, sample] = threads[i];
+        auto load = permille(sample.cycles);
+        chprintf(chp, "%-8s %5u %3u.%u %9u\r\n", name, stackFree, load / 10, load % 10, sample.switches);
+    }
+    auto load = permille(isr.cycles);
+    chprintf(chp, "%-8s %5s %3u.%u %9u\r\n", "irq", "-", load / 10, load % 10, isr.switches);
+    chprintf(chp, "Window %ums\r\n", static_cast<uint32_t>(total / (STM32_HCLK / 1000)));
+}
+
+static void cmd_stream_bin(BaseSequentialStream* chp, int argc, char* argv[])
+{
+    if(StreamParams params; parseStreamParams(argc, argv, params)) {
+        uint16_t sequence{};
+        streamSamples(chp, params, [&sequence](PacketBatch& batch) {
+            uint8_t frame[telemetry::FRAME_MAX_SIZE];
+            batch.put(frame, telemetry::encodeFrame(telemetry::takeSample(), sequence++, frame));
+        });
+    }
+    else {
+        usage(chp,
+              "stream-bin [period_ms [batch]]\r\n"
+              "  Continuously reports the same values as 'poll' in COBS framed binary form\r\n"
+              "  with CRC16, see telemetry.h for the layout\r\n"
+              "  The arguments are the same as for 'poll'\r\n  Press CTRL-C to exit");
+    }
+}
+
+static void cmd_stream(BaseSequentialStream* chp, int argc, char* argv[])
+{
+    using enum stream::Format;
+    static constexpr std::string_view formatNames[] = {"off", "text", "bin"};
+    if(!argc) {
+        chprintf(chp, "%s\r\n", formatNames[std::to_underlying(stream::getFormat())].data());
+        return;
+    }
+    if(argc == 1) {
+        for(uint8_t i{}; i < std::size(formatNames); ++i) {
+            if(formatNames[i] == argv[0]) {
+                stream::setFormat(static_cast<stream::Format>(i));
+                return;
+            }
+        }
+    }
+    usage(chp,
+          "stream [off|text|bin]\r\n"
+          "  Selects the format of the telemetry sent once per second on the second\r\n"
+          "  (data) serial port, the same as 'poll' or 'stream-bin' output");
+}
+
+static void cmd_stream_delta(BaseSequentialStream* chp, int argc, char* argv[])
+{
+    if(!argc) {
+        auto [vMainDeadband, vBatDeadband, heartbeat] = stream::getDelta();
+        if(heartbeat) {
+            chprintf(chp, "Main %umV, VBAT %umV, heartbeat %us\r\n", vMainDeadband, vBatDeadband, heartbeat);
+        }
+        else {
+            chprintf(chp, "off\r\n");
+        }
+        return;
+    }
+    if(argc == 1 && std::string_view{argv[0]} == "off") {
+        stream::setDelta({});
+        return;
+    }
+    if(argc == 3) {
+        uint32_t vMainDeadband = atoi(argv[0]);
+        uint32_t vBatDeadband = atoi(argv[1]);
+        uint32_t heartbeat = atoi(argv[2]);
+        if(vMainDeadband <= UINT16_MAX && vBatDeadband <= UINT16_MAX && heartbeat && heartbeat <= 3600) {
+            stream::setDelta({static_cast<uint16_t>(vMainDeadband),
+                              static_cast<uint16_t>(vBatDeadband),
+                              static_cast<uint16_t>(heartbeat)});
+            return;
+        }
+    }
+    usage(chp,
+          "stream-delta [off | <main_mV> <vbat_mV> <heartbeat_s>]\r\n"
+          "  The data port sends a sample only on a state change, when Main or VBAT\r\n"
+          "  moves by the deadband or after the heartbeat period (1-3600s)");
+}
+
+static void cmd_trace(BaseSequentialStream* chp, int argc, char* argv[])
+{
+    if(!argc) {
+        trace::dump(chp);
+    }
+    else if(argc == 1 && std::string_view{argv[0]} == "clear") {
+        trace::clear();
+    }
+    else {
+        usage(chp,
+              "trace [clear]\r\n"
+              "  Dumps the event trace ring in binary form or clears it");
+    }
+}
+
+/*
+ * Machine mode: no echo and prompt, a line may contain several ';' separated commands.
+ * The output of every command is followed by a status line: "OK", "ERR usage" (invalid arguments),
+ * "ERR unknown" (no such command), "ERR args" (too many arguments) or "ERR overflow" (the whole line is too long).
+ * "exit" or CTRL-D returns to the interactive shell.
+ */
+constexpr size_t MACHINE_LINE_LENGTH = 96;
+static bool machineMode;
+
+// Returns the line length, MACHINE_LINE_LENGTH if it doesn't fit, -1 on CTRL-D or disconnection
+static int readLine(BaseSequentialStream* chp, char (&line)[MACHINE_LINE_LENGTH])
+{
+    int len{};
+    bool overflow{};
+    while(true) {
+        msg_t c = streamGet(chp);
+        if(c < MSG_OK || c == CTRL_D) {
+            return -1;
+        }
+        if(c == '\r' || c == '\n') {
+            if(overflow) {
+                return MACHINE_LINE_LENGTH;
+            }
+            if(len) {
+                line[len] = '\0';
+                return len;
+            }
+        }
+        else if(len < static_cast<int>(MACHINE_LINE_LENGTH - 1)) {
+            line[len++] = static_cast<char>(c);
+        }
+        else {
+            overflow = true;
+        }
+    }
+}
+
+// Returns false if the command is "exit"
+static bool execute(BaseSequentialStream* chp, char* cmdLine)
+{
+    char* saveptr;
+    char* name = strtok_r(cmdLine, " \t", &saveptr);
+    if(!name) {
+        return true;
+    }
+    if(std::string_view{name} == "exit") {
+        chprintf(chp, "OK\r\n");
+        return false;
+    }
+    char* argv[SHELL_MAX_ARGUMENTS + 1];
+    int argc{};
+    while(char* arg = strtok_r(nullptr, " \t", &saveptr)) {
+        if(argc == SHELL_MAX_ARGUMENTS) {
+            chprintf(chp, "ERR args\r\n");
+            return true;
+        }
+        argv[argc++] = arg;
+    }
+    argv[argc] = nullptr;
+    for(const auto* cmd = commands; cmd->sc_name != nullptr; ++cmd) {
+        if(std::string_view{name} == cmd->sc_name) {
+            commandFailed = false;
+            cmd->sc_function(chp, argc, argv);
+            chprintf(chp, commandFailed ? "ERR usage\r\n" : "OK\r\n");
+            return true;
+        }
+    }
+    chprintf(chp, "ERR unknown\r\n");
+    return true;
+}
+
+static void cmd_machine(BaseSequentialStream* chp, int argc, char* /*argv*/[])
+{
+    if(argc) {
+        usage(chp,
+              "Switches to machine mode: no echo and prompt, ';' separated commands,\r\n"
+              "  every command output is terminated with \"OK\" or \"ERR <reason>\" line.\r\n"
+              "  \"exit\" returns to the interactive mode");
+        return;
+    }
+    if(machineMode) {
+        return;
+    }
+    machineMode = true;
+    chprintf(chp, "OK\r\n");
+    char line[MACHINE_LINE_LENGTH];
+    for(bool active = true; active;) {
+        int len = readLine(chp, line);
+        if(len < 0) {
+            break;
+        }
+        if(len == static_cast<int>(MACHINE_LINE_LENGTH)) {
+            chprintf(chp, "ERR overflow\r\n");
+            continue;
+        }
+        char* saveptr;
+        for(char* cmd = strtok_r(line, ";", &saveptr); cmd && active; cmd = strtok_r(nullptr, ";", &saveptr)) {
+            active = execute(chp, cmd);
+        }
+    }
+    machineMode = false;
+}
+
+static THD_WORKING_AREA(SHELL_WA_SIZE, 640);
 void shellRun()
 {
     shellInit();
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "stream_handler.h"
+#include "hal.h"
+#include "telemetry.h"
+#include "usbcfg.h"
+#include <atomic>
+
+namespace stream {
+
+static constexpr sysinterval_t PERIOD = TIME_S2I(1);
+
+static std::atomic<Format> format{Format::Text};
+static Delta delta;
+// Forces the next sample to be sent after the settings change
+static std::atomic_bool resync;
+
+Format getFormat()
+{
+    return format.load(std::memory_order_relaxed);
+}
+
+void setFormat(Format newFormat)
+{
+    format.store(newFormat, std::memory_order_relaxed);
+    resync = true;
+}
+
+Delta getDelta()
+{
+    chSysLock();
+    Delta result = delta;
+    chSysUnlock();
+    return result;
+}
+
+void setDelta(const Delta& newDelta)
+{
+    chSysLock();
+    delta = newDelta;
+    chSysUnlock();
+    resync = true;
+}
+
+static bool exceeds(uint16_t val, uint16_t prev, uint16_t deadband)
+{
+    return (val > prev ? val - prev : prev - val) >= deadband;
+}
+
+static bool changed(const telemetry::Sample& sample, const telemetry::Sample& prev, const Delta& settings)
+{
+    return sample.state != prev.state || exceeds(sample.vMain, prev.vMain, settings.vMainDeadband) ||
+           exceeds(sample.vBat, prev.vBat, settings.vBatDeadband) ||
+           sample.tick - prev.tick >= settings.heartbeat * CH_CFG_ST_FREQUENCY;
+}
+
+/*
+ * The writes never wait for the host, if it doesn't read the port only the latest sample is kept.
+ */
+static telemetry::Writer writer{&SDU2};
+
+static void send(const uint8_t* data, size_t len)
+{
+    writer.write(data, len);
+}
+
+static THD_WORKING_AREA(STREAM_WA_SIZE, 256);
+THD_FUNCTION(streamThread, )
+{
+    uint16_t sequence{};
+    telemetry::Sample prevSample{};
+    systime_t prev = chVTGetSystemTime();
+    while(true) {
+        auto settings = getDelta();
+        bool onChange = settings.heartbeat != 0;
+        prev = chThdSleepUntilWindowed(prev, chTimeAddX(prev, onChange ? TIME_MS2I(monitor::PERIOD_MS) : PERIOD));
+        auto fmt = getFormat();
+        if(fmt == Format::Off) {
+            continue;
+        }
+        auto sample = telemetry::takeSample();
+        if(onChange && !resync && !changed(sample, prevSample, settings)) {
+            continue;
+        }
+        resync = false;
+        prevSample = sample;
+        if(fmt == Format::Text) {
+            char line[telemetry::LINE_MAX_SIZE];
+            send((const uint8_t*)line, telemetry::formatLine(sample, line));
+        }
+        else {
+            uint8_t frame[telemetry::FRAME_MAX_SIZE];
+            send(frame, telemetry::encodeFrame(sample, sequence++, frame));
+        }
+    }
+}
+
+void run()
+{
+    auto* thd = chThdCreateStatic(STREAM_WA_SIZE, sizeof(STREAM_WA_SIZE), NORMALPRIO, streamThread, nullptr);
+    chRegSetThreadNameX(thd, "stream");
+}
+
+} // stream
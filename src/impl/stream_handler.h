@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef STREAM_HANDLER_H
+#define STREAM_HANDLER_H
+
+#include <cstdint>
+
+// Telemetry stream on the second CDC function, the first one is left for the shell
+namespace stream {
+
+enum class Format : uint8_t { Off, Text, Binary };
+
+Format getFormat();
+void setFormat(Format format);
+
+/*
+ * On-change mode: the sample is sent only when the state changes, a voltage moves by the deadband
+ * from the last sent value or the heartbeat period expires. The changes are checked every monitor period.
+ * Zero heartbeat disables the mode, the samples are sent once per second.
+ */
+struct Delta
+{
+    uint16_t vMainDeadband; // mV
+    uint16_t vBatDeadband;  // mV
+    uint16_t heartbeat;     // s
+};
+
+Delta getDelta();
+void setDelta(const Delta& delta);
+
+void run();
+
+} // stream
+
+#endif // STREAM_HANDLER_H
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "telemetry.h"
+#include "cal_data.h"
+#include "ch.h"
+#include "chprintf.h"
+#include "crc16.h"
+#include <cstring>
+#include <type_traits>
+
+namespace telemetry {
+
+class LeWriter
+{
+private:
+    uint8_t* pos_;
+public:
+    LeWriter(uint8_t* buf) : pos_{buf}
+    { }
+    template<typename T>
+    LeWriter& put(T val)
+    {
+        auto raw = static_cast<std::make_unsigned_t<T>>(val);
+        for(size_t i{}; i < sizeof(T); ++i) {
+            *pos_++ = raw & 0xFF;
+            raw >>= 8;
+        }
+        return *this;
+    }
+};
+
+size_t encodeFrame(const Sample& sample, uint16_t sequence, uint8_t (&out)[FRAME_MAX_SIZE])
+{
+    using monitor::to_underlying;
+    uint8_t payload[FRAME_PAYLOAD_SIZE];
+    LeWriter writer{payload};
+    writer.put(FRAME_VERSION)
+      .put(sequence)
+      .put(sample.tick)
+      .put(sample.vMain)
+      .put(sample.vBat)
+      .put(sample.vBal)
+      .put(sample.percent)
+      .put(static_cast<uint8_t>(to_underlying(sample.state)))
+      .put(sample.runTime);
+    writer.put(Utils::crc16(payload, FRAME_PAYLOAD_SIZE - sizeof(uint16_t)));
+    auto len = cobs::encode(payload, FRAME_PAYLOAD_SIZE, out);
+    out[len++] = 0;
+    return len;
+}
+
+size_t formatLine(const Sample& sample, char (&out)[LINE_MAX_SIZE])
+{
+    return chsnprintf(out,
+                      LINE_MAX_SIZE,
+                      "%u  %u  %u  %d  %u  %u  %s\r\n",
+                      sample.tick,
+                      sample.vMain,
+                      sample.vBat,
+                      sample.vBal,
+                      sample.percent,
+                      sample.runTime,
+                      monitor::toString(sample.state).data());
+}
+
+static_assert(SERIAL_USB_BUFFERS_SIZE >= Writer::MAX_SIZE, "A write must fit into a single USB buffer");
+
+static uint32_t dropped;
+
+static void addDropped(uint32_t samples)
+{
+    chSysLock();
+    dropped += samples;
+    chSysUnlock();
+}
+
+uint32_t droppedSamples()
+{
+    chSysLock();
+    uint32_t result = dropped;
+    chSysUnlock();
+    return result;
+}
+
+void Writer::discard()
+{
+    addDropped(pendingSamples_);
+    pendingLen_ = pendingSamples_ = 0;
+}
+
+// Writes the data only if it fits entirely, the writes never exceed the USB buffer size
+bool Writer::trySend(const uint8_t* data, size_t len)
+{
+    auto* obqp = &sdu_->obqueue;
+    chSysLock();
+    // With a buffer in progress the rest of it or the next free one takes the packet, otherwise a free buffer does
+    bool fits = obqp->ptr != nullptr ? (static_cast<size_t>(obqp->top - obqp->ptr) >= len || bqSpaceI(obqp) > 1)
+                                     : bqSpaceI(obqp) > 0;
+    chSysUnlock();
+    return fits && chnWriteTimeout(sdu_, data, len, TIME_IMMEDIATE) == len;
+}
+
+bool Writer::write(const uint8_t* data, size_t len, uint8_t samples)
+{
+    if(pendingLen_ && trySend(pending_, pendingLen_)) {
+        pendingLen_ = pendingSamples_ = 0;
+    }
+    if(!pendingLen_ && trySend(data, len)) {
+        return true;
+    }
+    addDropped(pendingSamples_);
+    memcpy(pending_, data, len);
+    pendingLen_ = len;
+    pendingSamples_ = samples;
+    return false;
+}
+
+// Host epoch at the zero tick, ms
+static int64_t epochOffsetMs;
+
+uint32_t setEpoch(uint64_t epochMs)
+{
+    chSysLock();
+    const uint64_t now = chVTGetTimeStampI();
+    epochOffsetMs = epochMs - now * 1000 / CH_CFG_ST_FREQUENCY;
+    chSysUnlock();
+    return now;
+}
+
+uint32_t epochSeconds()
+{
+    chSysLock();
+    const int64_t offset = epochOffsetMs;
+    const uint64_t now = chVTGetTimeStampI();
+    chSysUnlock();
+    if(!offset) {
+        return 0;
+    }
+    return (offset + static_cast<int64_t>(now * 1000 / CH_CFG_ST_FREQUENCY)) / 1000;
+}
+
+Sample takeSample()
+{
+    using namespace monitor;
+    using enum State;
+    chSysLock();
+    auto tick = static_cast<uint32_t>(chVTGetTimeStampI());
+    chSysUnlock();
+    uint16_t vBat = voltages[AdcVBat].load(std::memory_order_relaxed);
+    auto vBal = vBat - (voltages[AdcBat1].load(std::memory_order_relaxed) * batteryProfile().cells);
+    return {tick,
+            voltages[AdcMain].load(std::memory_order_relaxed),
+            vBat,
+            static_cast<int16_t>(vBal),
+            level.load(std::memory_order_relaxed),
+            state,
+            runTime.load(std::memory_order_relaxed)};
+}
+
+} // telemetry
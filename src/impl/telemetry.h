@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "cobs.h"
+#include "hal.h"
+#include "monitor.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace telemetry {
+
+struct Sample
+{
+    uint32_t tick; // system ticks, CH_CFG_ST_FREQUENCY
+    uint16_t vMain;
+    uint16_t vBat;
+    int16_t vBal;
+    uint8_t percent;
+    monitor::State state;
+    // s to empty during discharge, to the charge cutoff during charge, monitor::RUN_TIME_UNKNOWN otherwise
+    uint16_t runTime;
+};
+
+/*
+ * Binary frame, all fields are little endian:
+ *  u8 version, u16 sequence, u32 tick, u16 vMain, u16 vBat, i16 vBal, u8 percent, u8 state, u16 runTime,
+ *  u16 CRC16
+ * The CRC (CCITT-FALSE) covers all the preceding bytes. The frame is COBS encoded and terminated with zero.
+ */
+constexpr uint8_t FRAME_VERSION = 2;
+constexpr size_t FRAME_PAYLOAD_SIZE = 19;
+constexpr size_t FRAME_MAX_SIZE = cobs::maxEncodedSize(FRAME_PAYLOAD_SIZE) + 1;
+
+// Returns the number of bytes written to the out buffer including the delimiter
+size_t encodeFrame(const Sample& sample, uint16_t sequence, uint8_t (&out)[FRAME_MAX_SIZE]);
+
+// Text form of the sample, the 'poll' command line: tick vMain vBat vBal percent runTime state
+constexpr size_t LINE_MAX_SIZE = 64;
+size_t formatLine(const Sample& sample, char (&out)[LINE_MAX_SIZE]);
+
+Sample takeSample();
+
+// Host time set by the 'time-sync' command, returns the tick the epoch is bound to
+uint32_t setEpoch(uint64_t epochMs);
+// 0 until synchronized
+uint32_t epochSeconds();
+
+/*
+ * Never blocking output to a serial USB port. Data that doesn't fit into the USB buffers is held
+ * as pending and sent first when the space is available. Only the latest data is held: a newer write
+ * replaces the pending one (drop oldest) and the replaced samples are counted as dropped.
+ */
+class Writer
+{
+public:
+    static constexpr size_t MAX_SIZE = 64;
+private:
+    SerialUSBDriver* sdu_;
+    uint8_t pending_[MAX_SIZE];
+    size_t pendingLen_{};
+    uint8_t pendingSamples_{};
+    bool trySend(const uint8_t* data, size_t len);
+public:
+    Writer(SerialUSBDriver* sdu) : sdu_{sdu}
+    { }
+    // Returns false if the data has been left pending, len must not exceed MAX_SIZE
+    bool write(const uint8_t* data, size_t len, uint8_t samples = 1);
+    // Drops the pending data when the output stops
+    void discard();
+};
+
+// Total number of the samples dropped by all writers
+uint32_t droppedSamples();
+
+} // telemetry
+
+#endif // TELEMETRY_H
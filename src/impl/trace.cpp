@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "trace.h"
+#include "ch.h"
+#include "type_traits_ex.h"
+
+namespace trace {
+
+static constexpr size_t TRACE_DEPTH = 64;
+static_assert(Utils::IsPowerOf2(TRACE_DEPTH));
+
+static Event ring[TRACE_DEPTH];
+// Total number of records ever written, the ring position is taken from the lower bits
+static uint32_t head;
+static bool frozen;
+
+// The host may stop reading in the middle of the dump
+static constexpr sysinterval_t WRITE_TIMEOUT = TIME_MS2I(500);
+
+static bool send(BaseSequentialStream* chp, const void* data, size_t len)
+{
+    auto* asyncCh = reinterpret_cast<BaseAsynchronousChannel*>(chp);
+    return chnWriteTimeout(asyncCh, static_cast<const uint8_t*>(data), len, WRITE_TIMEOUT) == len;
+}
+
+void record(Id id, uint8_t arg8, uint16_t arg16)
+{
+    // Cortex-M0 lacks exclusive access instructions, so the slot is claimed
+    // within a short section with masked interrupts instead
+    syssts_t sts = chSysGetStatusAndLockX();
+    if(!frozen) {
+        ring[head++ & (TRACE_DEPTH - 1)] = {static_cast<uint32_t>(chVTGetTimeStampI()), id, arg8, arg16};
+    }
+    chSysRestoreStatusX(sts);
+}
+
+void dump(BaseSequentialStream* chp)
+{
+    // Stop recording while the ring is being sent, the stack is too small to hold a copy
+    chSysLock();
+    frozen = true;
+    uint32_t count = head < TRACE_DEPTH ? head : TRACE_DEPTH;
+    uint32_t first = head - count;
+    chSysUnlock();
+    DumpHeader header{{'U', 'T', 'R', 'C'},
+                      DUMP_VERSION,
+                      sizeof(Event),
+                      static_cast<uint16_t>(count),
+                      CH_CFG_ST_FREQUENCY};
+    // The ring may wrap, send it in two parts at most. A timed out write drops the rest, the recording
+    // must not stay stopped
+    auto begin = first & (TRACE_DEPTH - 1);
+    auto tail = TRACE_DEPTH - begin < count ? TRACE_DEPTH - begin : count;
+    if(send(chp, &header, sizeof header) && send(chp, &ring[begin], tail * sizeof(Event))) {
+        send(chp, &ring[0], (count - tail) * sizeof(Event));
+    }
+    chSysLock();
+    frozen = false;
+    chSysUnlock();
+}
+
+void clear()
+{
+    chSysLock();
+    head = 0;
+    chSysUnlock();
+}
+
+} // trace
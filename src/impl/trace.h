@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "hal.h"
+#include <cstdint>
+
+namespace trace {
+
+enum Id : uint8_t {
+    AdcBurst,     // arg16: VBAT mV, arg8: conversion result
+    StateChange,  // arg8: previous state << 4 | new state, arg16: VBAT mV
+    GpioOutput,   // arg16: GPIOA output latch
+    DisplayStart,
+    DisplayEnd,
+    ShellCommand, // arg8: command table index, arg16: number of arguments
+};
+
+struct Event
+{
+    uint32_t timestamp; // system ticks, CH_CFG_ST_FREQUENCY
+    Id id;
+    uint8_t arg8;
+    uint16_t arg16;
+};
+static_assert(sizeof(Event) == 8);
+
+// Header of the binary dump, followed by the records in chronological order
+struct DumpHeader
+{
+    char magic[4];
+    uint8_t version;
+    uint8_t recordSize;
+    uint16_t count;
+    uint32_t tickFrequency;
+};
+static_assert(sizeof(DumpHeader) == 12);
+
+constexpr uint8_t DUMP_VERSION = 1;
+
+// Safe to call from any thread or ISR
+void record(Id id, uint8_t arg8 = 0, uint16_t arg16 = 0);
+// The stream must be an asynchronous channel, the serial USB port of the shell
+void dump(BaseSequentialStream* chp);
+void clear();
+
+} // trace
+
+#endif // TRACE_H
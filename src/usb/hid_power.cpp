@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "hid_power.h"
+#include "usbcfg.h"
+
+/* HID class specific requests (HID 1.11 section 7.2).*/
+#define HID_GET_REPORT 0x01U
+#define HID_GET_IDLE 0x02U
+#define HID_GET_PROTOCOL 0x03U
+#define HID_SET_REPORT 0x09U
+#define HID_SET_IDLE 0x0AU
+#define HID_SET_PROTOCOL 0x0BU
+
+enum ReportId : uint8_t {
+    ReportPresentStatus = 1,
+    ReportRemainingCapacity,
+    ReportRunTimeToEmpty,
+    ReportVoltage,
+    ReportCapacityInfo, // Feature only
+};
+
+/* Reports sent on the interrupt endpoint, bit number is the report ID.*/
+static constexpr uint8_t INPUT_REPORTS =
+  1U << ReportPresentStatus | 1U << ReportRemainingCapacity | 1U << ReportRunTimeToEmpty | 1U << ReportVoltage;
+
+/* Smaller voltage changes are reported on request only.*/
+static constexpr uint16_t VOLTAGE_REPORT_DEADBAND = 20;
+
+/* Percentage based capacity reporting, CapacityMode value.*/
+static constexpr uint8_t CAPACITY_MODE_PERCENT = 2;
+
+/*
+ * Every value is declared both as Input, to be sent on change,
+ * and as Feature, to be read with GET_REPORT by the host UPS stacks.
+ */
+const uint8_t hid_power_report_descriptor[HID_POWER_REPORT_DESCRIPTOR_SIZE] = {
+  0x05, 0x84,                   /* Usage Page (Power Device).               */
+  0x09, 0x04,                   /* Usage (UPS).                             */
+  0xA1, 0x01,                   /* Collection (Application).                */
+  0x09, 0x24,                   /*   Usage (Power Summary).                 */
+  0xA1, 0x00,                   /*   Collection (Physical).                 */
+  0x05, 0x85,                   /*     Usage Page (Battery System).         */
+  0x15, 0x00,                   /*     Logical Minimum (0).                 */
+  0x25, 0x01,                   /*     Logical Maximum (1).                 */
+  0x75, 0x01,                   /*     Report Size (1).                     */
+  0x85, ReportPresentStatus,    /*     Report ID.                           */
+  0x09, 0xD0,                   /*     Usage (ACPresent).                   */
+  0x09, 0x44,                   /*     Usage (Charging).                    */
+  0x09, 0x45,                   /*     Usage (Discharging).                 */
+  0x09, 0x42,                   /*     Usage (BelowRemainingCapacityLimit). */
+  0x0B, 0x69, 0x00, 0x84, 0x00, /*     Usage (ShutdownImminent).            */
+  0x95, 0x05,                   /*     Report Count (5).                    */
+  0x81, 0x02,                   /*     Input (Data, Var, Abs).              */
+  0x95, 0x03,                   /*     Report Count (3).                    */
+  0x81, 0x01,                   /*     Input (Const).                       */
+  0x09, 0xD0,                   /*     Usage (ACPresent).                   */
+  0x09, 0x44,                   /*     Usage (Charging).                    */
+  0x09, 0x45,                   /*     Usage (Discharging).                 */
+  0x09, 0x42,                   /*     Usage (BelowRemainingCapacityLimit). */
+  0x0B, 0x69, 0x00, 0x84, 0x00, /*     Usage (ShutdownImminent).            */
+  0x95, 0x05,                   /*     Report Count (5).                    */
+  0xB1, 0x02,                   /*     Feature (Data, Var, Abs).            */
+  0x95, 0x03,                   /*     Report Count (3).                    */
+  0xB1, 0x01,                   /*     Feature (Const).                     */
+  0x85, ReportRemainingCapacity, /*    Report ID.                           */
+  0x25, 0x64,                   /*     Logical Maximum (100).               */
+  0x75, 0x08,                   /*     Report Size (8).                     */
+  0x95, 0x01,                   /*     Report Count (1).                    */
+  0x09, 0x66,                   /*     Usage (RemainingCapacity).           */
+  0x81, 0x02,                   /*     Input (Data, Var, Abs).              */
+  0x09, 0x66,                   /*     Usage (RemainingCapacity).           */
+  0xB1, 0x02,                   /*     Feature (Data, Var, Abs).            */
+  0x85, ReportRunTimeToEmpty,   /*     Report ID.                           */
+  0x27, 0xFF, 0xFF, 0x00, 0x00, /*     Logical Maximum (65535).             */
+  0x75, 0x10,                   /*     Report Size (16).                    */
+  0x66, 0x01, 0x10,             /*     Unit (s).                            */
+  0x09, 0x68,                   /*     Usage (RunTimeToEmpty).              */
+  0x81, 0x02,                   /*     Input (Data, Var, Abs).              */
+  0x09, 0x68,                   /*     Usage (RunTimeToEmpty).              */
+  0xB1, 0x02,                   /*     Feature (Data, Var, Abs).            */
+  0x85, ReportVoltage,          /*     Report ID.                           */
+  0x05, 0x84,                   /*     Usage Page (Power Device).           */
+  0x67, 0x21, 0xD1, 0xF0, 0x00, /*     Unit (V, based on g and cm: 1e-7 V). */
+  0x55, 0x04,                   /*     Unit Exponent (4), i.e. mV.          */
+  0x09, 0x30,                   /*     Usage (Voltage).                     */
+  0x81, 0x02,                   /*     Input (Data, Var, Abs).              */
+  0x09, 0x30,                   /*     Usage (Voltage).                     */
+  0xB1, 0x02,                   /*     Feature (Data, Var, Abs).            */
+  0x85, ReportCapacityInfo,     /*     Report ID.                           */
+  0x05, 0x85,                   /*     Usage Page (Battery System).         */
+  0x65, 0x00,                   /*     Unit (None).                         */
+  0x55, 0x00,                   /*     Unit Exponent (0).                   */
+  0x26, 0xFF, 0x00,             /*     Logical Maximum (255).               */
+  0x75, 0x08,                   /*     Report Size (8).                     */
+  0x95, 0x04,                   /*     Report Count (4).                    */
+  0x09, 0x2C,                   /*     Usage (CapacityMode).                */
+  0x09, 0x83,                   /*     Usage (DesignCapacity).              */
+  0x09, 0x67,                   /*     Usage (FullChargeCapacity).          */
+  0x09, 0x29,                   /*     Usage (RemainingCapacityLimit).      */
+  0xB1, 0x02,                   /*     Feature (Data, Var, Abs).            */
+  0xC0,                         /*   End Collection.                        */
+  0xC0                          /* End Collection.                          */
+};
+
+static HidPowerStatus status;
+static uint16_t reportedVoltage;
+static uint8_t pendingReports;
+static uint8_t idleRate;
+static uint8_t txBuf[8];
+static uint8_t ctrlBuf[8];
+
+static size_t buildReport(uint8_t id, uint8_t* buf)
+{
+    buf[0] = id;
+    switch(id) {
+        case ReportPresentStatus:
+            buf[1] = status.acPresent | status.charging << 1 | status.discharging << 2 |
+                     status.belowRemainingCapacityLimit << 3 | status.shutdownImminent << 4;
+            return 2;
+        case ReportRemainingCapacity:
+            buf[1] = status.remainingCapacity;
+            return 2;
+        case ReportRunTimeToEmpty:
+            buf[1] = status.runTimeToEmpty & 0xFF;
+            buf[2] = status.runTimeToEmpty >> 8;
+            return 3;
+        case ReportVoltage:
+            buf[1] = status.voltage & 0xFF;
+            buf[2] = status.voltage >> 8;
+            return 3;
+        case ReportCapacityInfo:
+            buf[1] = CAPACITY_MODE_PERCENT;
+            buf[2] = 100;
+            buf[3] = 100;
+            buf[4] = status.remainingCapacityLimit;
+            return 5;
+    }
+    return 0;
+}
+
+static void sendNextI(USBDriver* usbp)
+{
+    if(!pendingReports || usbGetDriverStateI(usbp) != USB_ACTIVE ||
+       usbGetTransmitStatusI(usbp, USB_HID_INTERRUPT_EP)) {
+        return;
+    }
+    uint8_t id = __builtin_ctz(pendingReports);
+    pendingReports &= ~(1U << id);
+    if(id == ReportVoltage) {
+        reportedVoltage = status.voltage;
+    }
+    usbStartTransmitI(usbp, USB_HID_INTERRUPT_EP, txBuf, buildReport(id, txBuf));
+}
+
+static void hidTransmitted(USBDriver* usbp, usbep_t ep)
+{
+    (void)ep;
+    osalSysLockFromISR();
+    sendNextI(usbp);
+    osalSysUnlockFromISR();
+}
+
+static USBInEndpointState ep3instate;
+
+static const USBEndpointConfig ep3config =
+  {USB_EP_MODE_TYPE_INTR, nullptr, hidTransmitted, nullptr, 0x0008, 0x0000, &ep3instate, nullptr, 1, nullptr};
+
+void hidPowerUpdate(const HidPowerStatus& newStatus)
+{
+    osalSysLock();
+    const auto& old = status;
+    if(newStatus.acPresent != old.acPresent || newStatus.charging != old.charging ||
+       newStatus.discharging != old.discharging ||
+       newStatus.belowRemainingCapacityLimit != old.belowRemainingCapacityLimit ||
+       newStatus.shutdownImminent != old.shutdownImminent) {
+        pendingReports |= 1U << ReportPresentStatus;
+    }
+    if(newStatus.remainingCapacity != old.remainingCapacity) {
+        pendingReports |= 1U << ReportRemainingCapacity;
+    }
+    if(newStatus.runTimeToEmpty != old.runTimeToEmpty) {
+        pendingReports |= 1U << ReportRunTimeToEmpty;
+    }
+    auto voltageDiff = newStatus.voltage - reportedVoltage;
+    if(voltageDiff >= VOLTAGE_REPORT_DEADBAND || voltageDiff <= -VOLTAGE_REPORT_DEADBAND) {
+        pendingReports |= 1U << ReportVoltage;
+    }
+    status = newStatus;
+    sendNextI(serusbcfg.usbp);
+    osalSysUnlock();
+}
+
+void hidPowerConfigureHookI(USBDriver* usbp)
+{
+    usbInitEndpointI(usbp, USB_HID_INTERRUPT_EP, &ep3config);
+    /* The host gets the whole state after (re)configuration.*/
+    pendingReports = INPUT_REPORTS;
+    sendNextI(usbp);
+}
+
+/*
+ * Handles the HID class requests addressed to the power device interface, called from the USB ISR.
+ */
+bool hidPowerRequestsHook(USBDriver* usbp)
+{
+    if((usbp->setup[0] & USB_RTYPE_TYPE_MASK) != USB_RTYPE_TYPE_CLASS) {
+        return false;
+    }
+    switch(usbp->setup[1]) {
+        case HID_GET_REPORT: {
+            osalSysLockFromISR();
+            size_t len = buildReport(usbp->setup[2], ctrlBuf);
+            osalSysUnlockFromISR();
+            if(!len) {
+                return false;
+            }
+            usbSetupTransfer(usbp, ctrlBuf, len, nullptr);
+            return true;
+        }
+        case HID_SET_REPORT:
+            /* All the values are read only, the data stage is accepted and discarded.*/
+            usbSetupTransfer(usbp, ctrlBuf, sizeof ctrlBuf, nullptr);
+            return true;
+        case HID_GET_IDLE:
+            usbSetupTransfer(usbp, &idleRate, 1, nullptr);
+            return true;
+        case HID_SET_IDLE:
+            idleRate = usbp->setup[3];
+            usbSetupTransfer(usbp, nullptr, 0, nullptr);
+            return true;
+        case HID_GET_PROTOCOL:
+        case HID_SET_PROTOCOL:
+            /* Boot protocol is not supported by this interface.*/
+            return false;
+    }
+    return false;
+}
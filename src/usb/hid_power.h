@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef HID_POWER_H
+#define HID_POWER_H
+
+#include "hal.h"
+
+// USB HID Power Device Class (usage pages 0x84/0x85) interface of the composite device
+
+#define USB_HID_INTERFACE 4
+#define USB_HID_INTERRUPT_EP 3
+
+/* HID class descriptor types.*/
+#define HID_DESCRIPTOR_HID 0x21U
+#define HID_DESCRIPTOR_REPORT 0x22U
+
+struct HidPowerStatus
+{
+    bool acPresent;
+    bool charging;
+    bool discharging;
+    bool belowRemainingCapacityLimit;
+    bool shutdownImminent;
+    uint8_t remainingCapacity;      // %
+    uint8_t remainingCapacityLimit; // %
+    uint16_t runTimeToEmpty;        // s
+    uint16_t voltage;               // mV
+};
+
+#define HID_POWER_REPORT_DESCRIPTOR_SIZE 144
+
+extern const uint8_t hid_power_report_descriptor[HID_POWER_REPORT_DESCRIPTOR_SIZE];
+
+// Called by the monitor, changed values are sent as input reports on the interrupt endpoint
+void hidPowerUpdate(const HidPowerStatus& status);
+
+void hidPowerConfigureHookI(USBDriver* usbp);
+bool hidPowerRequestsHook(USBDriver* usbp);
+
+#endif // HID_POWER_H
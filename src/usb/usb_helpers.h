@@ -43,6 +43,22 @@ consteval auto integer2usbDescriptor(T val)
 }
 } // Private
 
+// Built at runtime, the string is the hexadecimal representation of the N bytes
+template<std::size_t N>
+auto bytes2usbDescriptor(const uint8_t* in)
+{
+    constexpr char digits[] = "0123456789ABCDEF";
+    std::array<uint8_t, N * 4 + 2> arr{};
+    arr[0] = arr.size();
+    arr[1] = Private::USB_DESC_STRING_TYPE;
+    auto begin = &arr[2];
+    for(unsigned i{}; i < N; ++i) {
+        begin[i * 4] = digits[in[i] >> 4];
+        begin[i * 4 + 2] = digits[in[i] & 0x0F];
+    }
+    return arr;
+}
+
 template<std::size_t N>
 struct StringDescriptor
 {
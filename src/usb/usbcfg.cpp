@@ -15,10 +15,13 @@
 */
 
 #include "usbcfg.h"
+#include "hid_power.h"
 #include "usb_helpers.h"
+#include "version.h"
 
-/* Virtual serial port over USB.*/
+/* Virtual serial ports over USB, the shell and the telemetry stream.*/
 SerialUSBDriver SDU1;
+SerialUSBDriver SDU2;
 
 /*
  * Endpoints to be used for USBD1.
@@ -26,23 +29,26 @@ SerialUSBDriver SDU1;
 #define USB1_DATA_REQUEST_EP 1
 #define USB1_DATA_AVAILABLE_EP 1
 #define USB1_INTERRUPT_REQUEST_EP 2
+#define USB2_DATA_REQUEST_EP 4
+#define USB2_DATA_AVAILABLE_EP 4
+#define USB2_INTERRUPT_REQUEST_EP 5
 
 /*
  * USB Device Descriptor.
  */
 static const uint8_t vcom_device_descriptor_data[18] = {
-  USB_DESC_DEVICE(0x0110, /* bcdUSB (1.1).                    */
-                  0x02,   /* bDeviceClass (CDC).              */
-                  0x00,   /* bDeviceSubClass.                 */
-                  0x00,   /* bDeviceProtocol.                 */
-                  0x40,   /* bMaxPacketSize.                  */
-                  0x0483, /* idVendor (ST).                   */
-                  0x5740, /* idProduct.                       */
-                  0x0200, /* bcdDevice.                       */
-                  1,      /* iManufacturer.                   */
-                  2,      /* iProduct.                        */
-                  3,      /* iSerialNumber.                   */
-                  1)      /* bNumConfigurations.              */
+  USB_DESC_DEVICE(0x0110,           /* bcdUSB (1.1).                    */
+                  0xEF,             /* bDeviceClass (Miscellaneous).    */
+                  0x02,             /* bDeviceSubClass (Common Class).  */
+                  0x01,             /* bDeviceProtocol (IAD).           */
+                  0x40,             /* bMaxPacketSize.                  */
+                  0x0483,           /* idVendor (ST).                   */
+                  0x5740,           /* idProduct.                       */
+                  FIRMWARE_VERSION, /* bcdDevice.                       */
+                  1,                /* iManufacturer.                   */
+                  2,                /* iProduct.                        */
+                  3,                /* iSerialNumber.                   */
+                  1)                /* bNumConfigurations.              */
 };
 
 /*
@@ -50,15 +56,22 @@ static const uint8_t vcom_device_descriptor_data[18] = {
  */
 static const USBDescriptor vcom_device_descriptor = {sizeof vcom_device_descriptor_data, vcom_device_descriptor_data};
 
-/* Configuration Descriptor tree for a CDC.*/
-static const uint8_t vcom_configuration_descriptor_data[67] = {
+/* Configuration Descriptor tree for two CDCs and a HID Power Device.*/
+static const uint8_t vcom_configuration_descriptor_data[166] = {
   /* Configuration Descriptor.*/
-  USB_DESC_CONFIGURATION(67,   /* wTotalLength.                    */
-                         0x02, /* bNumInterfaces.                  */
+  USB_DESC_CONFIGURATION(166,  /* wTotalLength.                    */
+                         0x05, /* bNumInterfaces.                  */
                          0x01, /* bConfigurationValue.             */
                          0,    /* iConfiguration.                  */
                          0xC0, /* bmAttributes (self powered).     */
                          50),  /* bMaxPower (100mA).               */
+  /* Interface Association Descriptor, groups the CDC interfaces.*/
+  USB_DESC_INTERFACE_ASSOCIATION(0x00, /* bFirstInterface.                 */
+                                 0x02, /* bInterfaceCount.                 */
+                                 0x02, /* bFunctionClass (CDC).            */
+                                 0x02, /* bFunctionSubClass (ACM).         */
+                                 0x01, /* bFunctionProcotol (AT commands). */
+                                 0),   /* iInterface.                      */
   /* Interface Descriptor.*/
   USB_DESC_INTERFACE(0x00, /* bInterfaceNumber.                */
                      0x00, /* bAlternateSetting.               */
@@ -102,7 +115,7 @@ static const uint8_t vcom_configuration_descriptor_data[67] = {
   /* Endpoint 2 Descriptor.*/
   USB_DESC_ENDPOINT(USB1_INTERRUPT_REQUEST_EP | 0x80,
                     0x03,   /* bmAttributes (Interrupt).        */
-                    0x0008, /* wMaxPacketSize.                  */
+                    0x0010, /* wMaxPacketSize.                  */
                     0xFF),  /* bInterval.                       */
   /* Interface Descriptor.*/
   USB_DESC_INTERFACE(0x01,  /* bInterfaceNumber.                */
@@ -124,15 +137,122 @@ static const uint8_t vcom_configuration_descriptor_data[67] = {
   USB_DESC_ENDPOINT(USB1_DATA_REQUEST_EP | 0x80, /* bEndpointAddress.*/
                     0x02,                        /* bmAttributes (Bulk).             */
                     0x0040,                      /* wMaxPacketSize.                  */
-                    0x00)                        /* bInterval.                       */
+                    0x00),                       /* bInterval.                       */
+  /* Interface Association Descriptor, groups the telemetry CDC interfaces.*/
+  USB_DESC_INTERFACE_ASSOCIATION(0x02, /* bFirstInterface.                 */
+                                 0x02, /* bInterfaceCount.                 */
+                                 0x02, /* bFunctionClass (CDC).            */
+                                 0x02, /* bFunctionSubClass (ACM).         */
+                                 0x01, /* bFunctionProcotol (AT commands). */
+                                 0),   /* iInterface.                      */
+  /* Interface Descriptor.*/
+  USB_DESC_INTERFACE(0x02, /* bInterfaceNumber.                */
+                     0x00, /* bAlternateSetting.               */
+                     0x01, /* bNumEndpoints.                   */
+                     0x02, /* bInterfaceClass (Communications
+                              Interface Class, CDC section
+                              4.2).                            */
+                     0x02, /* bInterfaceSubClass (Abstract
+                            Control Model, CDC section 4.3).   */
+                     0x01, /* bInterfaceProtocol (AT commands,
+                              CDC section 4.4).                */
+                     0),   /* iInterface.                      */
+  /* Header Functional Descriptor (CDC section 5.2.3).*/
+  USB_DESC_BYTE(5),     /* bLength.                         */
+  USB_DESC_BYTE(0x24),  /* bDescriptorType (CS_INTERFACE).  */
+  USB_DESC_BYTE(0x00),  /* bDescriptorSubtype (Header
+                           Functional Descriptor.           */
+  USB_DESC_BCD(0x0110), /* bcdCDC.                          */
+  /* Call Management Functional Descriptor. */
+  USB_DESC_BYTE(5),    /* bFunctionLength.                 */
+  USB_DESC_BYTE(0x24), /* bDescriptorType (CS_INTERFACE).  */
+  USB_DESC_BYTE(0x01), /* bDescriptorSubtype (Call Management
+                          Functional Descriptor).          */
+  USB_DESC_BYTE(0x00), /* bmCapabilities (D0+D1).          */
+  USB_DESC_BYTE(0x03), /* bDataInterface.                  */
+  /* ACM Functional Descriptor.*/
+  USB_DESC_BYTE(4),    /* bFunctionLength.                 */
+  USB_DESC_BYTE(0x24), /* bDescriptorType (CS_INTERFACE).  */
+  USB_DESC_BYTE(0x02), /* bDescriptorSubtype (Abstract
+                          Control Management Descriptor).  */
+  USB_DESC_BYTE(0x02), /* bmCapabilities.                  */
+  /* Union Functional Descriptor.*/
+  USB_DESC_BYTE(5),    /* bFunctionLength.                 */
+  USB_DESC_BYTE(0x24), /* bDescriptorType (CS_INTERFACE).  */
+  USB_DESC_BYTE(0x06), /* bDescriptorSubtype (Union
+                          Functional Descriptor).          */
+  USB_DESC_BYTE(0x02), /* bMasterInterface (Communication
+                          Class Interface).                */
+  USB_DESC_BYTE(0x03), /* bSlaveInterface0 (Data Class
+                          Interface).                      */
+  /* Endpoint 5 Descriptor.*/
+  USB_DESC_ENDPOINT(USB2_INTERRUPT_REQUEST_EP | 0x80,
+                    0x03,   /* bmAttributes (Interrupt).        */
+                    0x0008, /* wMaxPacketSize.                  */
+                    0xFF),  /* bInterval.                       */
+  /* Interface Descriptor.*/
+  USB_DESC_INTERFACE(0x03,  /* bInterfaceNumber.                */
+                     0x00,  /* bAlternateSetting.               */
+                     0x02,  /* bNumEndpoints.                   */
+                     0x0A,  /* bInterfaceClass (Data Class
+                               Interface, CDC section 4.5).     */
+                     0x00,  /* bInterfaceSubClass (CDC section
+                               4.6).                            */
+                     0x00,  /* bInterfaceProtocol (CDC section
+                               4.7).                            */
+                     0x00), /* iInterface.                      */
+  /* Endpoint 4 Descriptor.*/
+  USB_DESC_ENDPOINT(USB2_DATA_AVAILABLE_EP, /* bEndpointAddress.*/
+                    0x02,                   /* bmAttributes (Bulk).             */
+                    0x0040,                 /* wMaxPacketSize.                  */
+                    0x00),                  /* bInterval.                       */
+  /* Endpoint 4 Descriptor.*/
+  USB_DESC_ENDPOINT(USB2_DATA_REQUEST_EP | 0x80, /* bEndpointAddress.*/
+                    0x02,                        /* bmAttributes (Bulk).             */
+                    0x0040,                      /* wMaxPacketSize.                  */
+                    0x00),                       /* bInterval.                       */
+  /* Interface Descriptor.*/
+  USB_DESC_INTERFACE(USB_HID_INTERFACE, /* bInterfaceNumber.                */
+                     0x00,              /* bAlternateSetting.               */
+                     0x01,              /* bNumEndpoints.                   */
+                     0x03,              /* bInterfaceClass (HID).           */
+                     0x00,              /* bInterfaceSubClass (None).       */
+                     0x00,              /* bInterfaceProtocol (None).       */
+                     0x00),             /* iInterface.                      */
+  /* HID Descriptor (HID section 6.2.1).*/
+  USB_DESC_BYTE(9),                                /* bLength.                         */
+  USB_DESC_BYTE(0x21),                             /* bDescriptorType (HID).           */
+  USB_DESC_BCD(0x0111),                            /* bcdHID.                          */
+  USB_DESC_BYTE(0x00),                             /* bCountryCode.                    */
+  USB_DESC_BYTE(0x01),                             /* bNumDescriptors.                 */
+  USB_DESC_BYTE(0x22),                             /* bDescriptorType (Report).        */
+  USB_DESC_WORD(HID_POWER_REPORT_DESCRIPTOR_SIZE), /* wDescriptorLength.               */
+  /* Endpoint 3 Descriptor.*/
+  USB_DESC_ENDPOINT(USB_HID_INTERRUPT_EP | 0x80, /* bEndpointAddress.*/
+                    0x03,                        /* bmAttributes (Interrupt).        */
+                    0x0008,                      /* wMaxPacketSize.                  */
+                    0x0A)                        /* bInterval.                       */
 };
 
+/* Offset of the HID Descriptor in the Configuration Descriptor.*/
+#define HID_DESCRIPTOR_OFFSET 150
+
 /*
  * Configuration Descriptor wrapper.
  */
 static const USBDescriptor vcom_configuration_descriptor = {sizeof vcom_configuration_descriptor_data,
                                                             vcom_configuration_descriptor_data};
 
+/*
+ * HID Descriptor wrapper.
+ */
+static const USBDescriptor hid_descriptor = {9, &vcom_configuration_descriptor_data[HID_DESCRIPTOR_OFFSET]};
+
+/*
+ * HID Report Descriptor wrapper.
+ */
+static const USBDescriptor hid_report_descriptor = {sizeof hid_power_report_descriptor, hid_power_report_descriptor};
+
 /*
  * U.S. English language identifier.
  */
@@ -149,14 +269,15 @@ const auto vcom_string1 = "github.com/hrandib"_sdesc;
 const auto vcom_string2 = "12V Uninterruptible Power Supply"_sdesc;
 
 /*
- * Serial Number string.
+ * Serial Number string, 96-bit unique device ID.
  */
-const auto vcom_string3 = "20220901"_sdesc;
+static constexpr size_t UID_SIZE = 12;
+const auto vcom_string3 = bytes2usbDescriptor<UID_SIZE>(reinterpret_cast<const uint8_t*>(UID_BASE));
 
 /*
  * Strings wrappers array.
  */
-static const USBDescriptor vcom_strings[] = {{vcom_string1.size(), vcom_string0.data()},
+static const USBDescriptor vcom_strings[] = {{vcom_string0.size(), vcom_string0.data()},
                                              {vcom_string1.size(), vcom_string1.data()},
                                              {vcom_string2.size(), vcom_string2.data()},
                                              {vcom_string3.size(), vcom_string3.data()}};
@@ -179,6 +300,11 @@ static const USBDescriptor* get_descriptor(USBDriver* usbp, uint8_t dtype, uint8
             if(dindex < 4) {
                 return &vcom_strings[dindex];
             }
+            break;
+        case HID_DESCRIPTOR_HID:
+            return &hid_descriptor;
+        case HID_DESCRIPTOR_REPORT:
+            return &hid_report_descriptor;
     }
     return nullptr;
 }
@@ -212,11 +338,97 @@ static const USBEndpointConfig ep1config = {USB_EP_MODE_TYPE_BULK,
  */
 static USBInEndpointState ep2instate;
 
+/*
+ * CDC SERIAL_STATE notification (PSTN section 6.5.4), the last two bytes hold the state bitmap.
+ */
+static uint8_t serial_state_notification[10] = {
+  0xA1, /* bmRequestType.                   */
+  0x20, /* bNotification (SERIAL_STATE).    */
+  0x00,
+  0x00, /* wValue.                          */
+  0x00,
+  0x00, /* wIndex (communication interface).*/
+  0x02,
+  0x00, /* wLength.                         */
+  0x00,
+  0x00 /* Serial state bitmap.             */
+};
+static uint16_t serial_state;
+static bool serial_state_pending;
+
+/*
+ * Sends the latest serial state or postpones it until the endpoint is free.
+ */
+static void serial_state_send_i(USBDriver* usbp)
+{
+    if(usbGetDriverStateI(usbp) != USB_ACTIVE) {
+        /* Will be sent on the configuration event.*/
+        serial_state_pending = true;
+        return;
+    }
+    if(usbGetTransmitStatusI(usbp, USB1_INTERRUPT_REQUEST_EP)) {
+        serial_state_pending = true;
+        return;
+    }
+    serial_state_pending = false;
+    serial_state_notification[8] = serial_state & 0xFF;
+    serial_state_notification[9] = serial_state >> 8;
+    usbStartTransmitI(usbp, USB1_INTERRUPT_REQUEST_EP, serial_state_notification, sizeof serial_state_notification);
+}
+
+/*
+ * Interrupt IN completion callback, flushes the state changed during the transfer.
+ */
+static void serial_state_transmitted(USBDriver* usbp, usbep_t ep)
+{
+    (void)ep;
+    osalSysLockFromISR();
+    if(serial_state_pending) {
+        serial_state_send_i(usbp);
+    }
+    osalSysUnlockFromISR();
+}
+
 /**
  * @brief   EP2 initialization structure (IN only).
  */
 static const USBEndpointConfig ep2config =
-  {USB_EP_MODE_TYPE_INTR, nullptr, sduInterruptTransmitted, nullptr, 0x0010, 0x0000, &ep2instate, nullptr, 1, nullptr};
+  {USB_EP_MODE_TYPE_INTR, nullptr, serial_state_transmitted, nullptr, 0x0010, 0x0000, &ep2instate, nullptr, 1, nullptr};
+
+/**
+ * @brief   IN EP4 state.
+ */
+static USBInEndpointState ep4instate;
+
+/**
+ * @brief   OUT EP4 state.
+ */
+static USBOutEndpointState ep4outstate;
+
+/**
+ * @brief   EP4 initialization structure (both IN and OUT).
+ */
+static const USBEndpointConfig ep4config = {USB_EP_MODE_TYPE_BULK,
+                                            nullptr,
+                                            sduDataTransmitted,
+                                            sduDataReceived,
+                                            0x0040,
+                                            0x0040,
+                                            &ep4instate,
+                                            &ep4outstate,
+                                            2,
+                                            nullptr};
+
+/**
+ * @brief   IN EP5 state.
+ */
+static USBInEndpointState ep5instate;
+
+/**
+ * @brief   EP5 initialization structure (IN only).
+ */
+static const USBEndpointConfig ep5config =
+  {USB_EP_MODE_TYPE_INTR, nullptr, sduInterruptTransmitted, nullptr, 0x0008, 0x0000, &ep5instate, nullptr, 1, nullptr};
 
 /*
  * Handles the USB driver global events.
@@ -234,9 +446,18 @@ static void usb_event(USBDriver* usbp, usbevent_t event)
                must be used.*/
             usbInitEndpointI(usbp, USB1_DATA_REQUEST_EP, &ep1config);
             usbInitEndpointI(usbp, USB1_INTERRUPT_REQUEST_EP, &ep2config);
+            usbInitEndpointI(usbp, USB2_DATA_REQUEST_EP, &ep4config);
+            usbInitEndpointI(usbp, USB2_INTERRUPT_REQUEST_EP, &ep5config);
 
             /* Resetting the state of the CDC subsystem.*/
             sduConfigureHookI(&SDU1);
+            sduConfigureHookI(&SDU2);
+
+            /* Enabling the HID interrupt endpoint, the power status follows.*/
+            hidPowerConfigureHookI(usbp);
+
+            /* Reporting the current power state to the host.*/
+            serial_state_send_i(usbp);
 
             chSysUnlockFromISR();
             return;
@@ -249,6 +470,7 @@ static void usb_event(USBDriver* usbp, usbevent_t event)
 
             /* Disconnection event on suspend.*/
             sduSuspendHookI(&SDU1);
+            sduSuspendHookI(&SDU2);
 
             chSysUnlockFromISR();
             return;
@@ -257,6 +479,7 @@ static void usb_event(USBDriver* usbp, usbevent_t event)
 
             /* Connection event on wakeup.*/
             sduWakeupHookI(&SDU1);
+            sduWakeupHookI(&SDU2);
 
             chSysUnlockFromISR();
             return;
@@ -275,15 +498,42 @@ static void sof_handler(USBDriver* usbp)
 
     osalSysLockFromISR();
     sduSOFHookI(&SDU1);
+    sduSOFHookI(&SDU2);
     osalSysUnlockFromISR();
 }
 
+/*
+ * Dispatches the interface requests between the CDC and the HID functions.
+ */
+static bool requests_hook(USBDriver* usbp)
+{
+    if((usbp->setup[0] & USB_RTYPE_RECIPIENT_MASK) == USB_RTYPE_RECIPIENT_INTERFACE &&
+       usbp->setup[4] == USB_HID_INTERFACE) {
+        return hidPowerRequestsHook(usbp);
+    }
+    return sduRequestsHook(usbp);
+}
+
 /*
  * USB driver configuration.
  */
-const USBConfig usbcfg = {usb_event, get_descriptor, sduRequestsHook, sof_handler};
+const USBConfig usbcfg = {usb_event, get_descriptor, requests_hook, sof_handler};
+
+/*
+ * Updates the CDC serial state, the host is notified on the interrupt endpoint.
+ */
+void usbSetSerialState(uint16_t state)
+{
+    osalSysLock();
+    if(state != serial_state) {
+        serial_state = state;
+        serial_state_send_i(serusbcfg.usbp);
+    }
+    osalSysUnlock();
+}
 
 /*
- * Serial over USB driver configuration.
+ * Serial over USB driver configurations.
  */
 const SerialUSBConfig serusbcfg = {&USBD1, USB1_DATA_REQUEST_EP, USB1_DATA_AVAILABLE_EP, USB1_INTERRUPT_REQUEST_EP};
+const SerialUSBConfig serusbcfg2 = {&USBD1, USB2_DATA_REQUEST_EP, USB2_DATA_AVAILABLE_EP, USB2_INTERRUPT_REQUEST_EP};
@@ -21,7 +21,18 @@
 
 extern const USBConfig usbcfg;
 extern const SerialUSBConfig serusbcfg;
+extern const SerialUSBConfig serusbcfg2;
 extern SerialUSBDriver SDU1;
+extern SerialUSBDriver SDU2;
+
+/* CDC SERIAL_STATE bitmap (PSTN section 6.5.4).*/
+enum SerialStateBits : uint16_t {
+    SERIAL_STATE_DCD = 0x01,
+    SERIAL_STATE_DSR = 0x02,
+    SERIAL_STATE_RI = 0x08,
+};
+
+void usbSetSerialState(uint16_t state);
 
 #endif /* USBCFG_H */
 
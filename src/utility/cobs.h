@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2022 Dmytro Shestakov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef COBS_H
+#define COBS_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Consistent Overhead Byte Stuffing, the encoded data contains no zero bytes,
+// so a single zero can be used as the frame delimiter
+namespace cobs {
+
+constexpr size_t maxEncodedSize(size_t len)
+{
+    return len + len / 254 + 1;
+}
+
+// Returns the encoded length, the delimiter is not appended
+constexpr size_t encode(const uint8_t* in, size_t len, uint8_t* out)
+{
+    size_t codePos{};
+    size_t outPos{1};
+    uint8_t code{1};
+    for(size_t i{}; i < len; ++i) {
+        if(in[i]) {
+            out[outPos++] = in[i];
+            ++code;
+        }
+        if(!in[i] || code == 0xFF) {
+            out[codePos] = code;
+            code = 1;
+            codePos = outPos++;
+        }
+    }
+    out[codePos] = code;
+    return outPos;
+}
+
+} // cobs
+
+#endif // COBS_H